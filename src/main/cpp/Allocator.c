@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Allocator.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// keeps returned blocks 16 bytes aligned on every arch
+typedef union {
+	struct {
+		hipxel_MemoryContext *owner;
+		size_t size;
+	} info;
+	uint8_t padding[16];
+} hipxel_BlockHeader;
+
+static void *system_allocate(void *p, size_t size) {
+	return malloc(size);
+}
+
+static void *system_reallocate(void *p, void *ptr, size_t size) {
+	return realloc(ptr, size);
+}
+
+static void system_deallocate(void *p, void *ptr) {
+	free(ptr);
+}
+
+hipxel_Allocator hipxel_Allocator_system() {
+	hipxel_Allocator v;
+	v.allocate = system_allocate;
+	v.reallocate = system_reallocate;
+	v.deallocate = system_deallocate;
+	v.p = NULL;
+	return v;
+}
+
+static hipxel_MemoryContext defaultContext = {
+		{NULL, system_allocate, system_reallocate, system_deallocate}, 0, 0};
+
+static __thread hipxel_MemoryContext *boundContext = NULL;
+
+static void account(hipxel_MemoryContext *mc, int64_t delta) {
+	int64_t allocated = __atomic_add_fetch(&(mc->allocatedBytes), delta, __ATOMIC_RELAXED);
+
+	// workers of frame pipeline allocate on same context
+	int64_t peak = __atomic_load_n(&(mc->peakBytes), __ATOMIC_RELAXED);
+	while (allocated > peak && !__atomic_compare_exchange_n(&(mc->peakBytes), &peak, allocated,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+void hipxel_MemoryContext_init(hipxel_MemoryContext *mc, hipxel_Allocator allocator) {
+	mc->allocator = allocator;
+	mc->allocatedBytes = 0;
+	mc->peakBytes = 0;
+}
+
+void *hipxel_MemoryContext_allocate(hipxel_MemoryContext *mc, size_t size) {
+	if (NULL == mc)
+		mc = &defaultContext;
+
+	if (size > SIZE_MAX - sizeof(hipxel_BlockHeader))
+		return NULL;
+
+	hipxel_Allocator *a = &(mc->allocator);
+	hipxel_BlockHeader *h = a->allocate(a->p, sizeof(hipxel_BlockHeader) + size);
+	if (NULL == h)
+		return NULL;
+
+	h->info.owner = mc;
+	h->info.size = size;
+	account(mc, (int64_t) size);
+	return h + 1;
+}
+
+void *hipxel_MemoryContext_reallocate(hipxel_MemoryContext *mc, void *ptr, size_t size) {
+	if (NULL == ptr)
+		return hipxel_MemoryContext_allocate(mc, size);
+
+	if (size > SIZE_MAX - sizeof(hipxel_BlockHeader))
+		return NULL;
+
+	// block stays with context it was allocated from
+	hipxel_BlockHeader *h = ((hipxel_BlockHeader *) ptr) - 1;
+	hipxel_MemoryContext *owner = h->info.owner;
+	size_t oldSize = h->info.size;
+
+	hipxel_Allocator *a = &(owner->allocator);
+	hipxel_BlockHeader *nh = a->reallocate(a->p, h, sizeof(hipxel_BlockHeader) + size);
+	if (NULL == nh)
+		return NULL;
+
+	nh->info.size = size;
+	account(owner, (int64_t) size - (int64_t) oldSize);
+	return nh + 1;
+}
+
+void hipxel_MemoryContext_deallocate(void *ptr) {
+	if (NULL == ptr)
+		return;
+
+	hipxel_BlockHeader *h = ((hipxel_BlockHeader *) ptr) - 1;
+	hipxel_MemoryContext *owner = h->info.owner;
+
+	account(owner, -(int64_t) h->info.size);
+
+	hipxel_Allocator *a = &(owner->allocator);
+	a->deallocate(a->p, h);
+}
+
+hipxel_MemoryContext *hipxel_MemoryContext_bind(hipxel_MemoryContext *mc) {
+	hipxel_MemoryContext *previous = boundContext;
+	boundContext = mc;
+	return previous;
+}
+
+// libFLAC is built with malloc family redefined to these, see thirdparty/CMakeLists.txt
+
+void *hipxel_FlacMemory_malloc(size_t size) {
+	return hipxel_MemoryContext_allocate(boundContext, size);
+}
+
+void *hipxel_FlacMemory_calloc(size_t count, size_t size) {
+	if (size > 0 && count > SIZE_MAX / size)
+		return NULL;
+
+	void *p = hipxel_MemoryContext_allocate(boundContext, count * size);
+	if (NULL != p)
+		memset(p, 0, count * size);
+	return p;
+}
+
+void *hipxel_FlacMemory_realloc(void *ptr, size_t size) {
+	if (0 == size) {
+		hipxel_MemoryContext_deallocate(ptr);
+		return NULL;
+	}
+	return hipxel_MemoryContext_reallocate(boundContext, ptr, size);
+}
+
+void hipxel_FlacMemory_free(void *ptr) {
+	hipxel_MemoryContext_deallocate(ptr);
+}
+
+char *hipxel_FlacMemory_strdup(const char *s) {
+	size_t length = strlen(s) + 1;
+	char *copy = hipxel_MemoryContext_allocate(boundContext, length);
+	if (NULL != copy)
+		memcpy(copy, s, length);
+	return copy;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_ALLOCATOR
+#define HIPXEL_ALLOCATOR
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct hipxel_Allocator {
+	void *p;
+
+	void *(*allocate)(void *p, size_t size);
+
+	void *(*reallocate)(void *p, void *ptr, size_t size);
+
+	void (*deallocate)(void *p, void *ptr);
+} hipxel_Allocator;
+
+/**
+ * Allocations made through context are counted, so owner can report its footprint.
+ * Every block remembers its context, so it may be freed without knowing it.
+ */
+typedef struct hipxel_MemoryContext {
+	hipxel_Allocator allocator;
+	int64_t allocatedBytes;
+	int64_t peakBytes;
+} hipxel_MemoryContext;
+
+hipxel_Allocator hipxel_Allocator_system();
+
+void hipxel_MemoryContext_init(hipxel_MemoryContext *mc, hipxel_Allocator allocator);
+
+void *hipxel_MemoryContext_allocate(hipxel_MemoryContext *mc, size_t size);
+
+void *hipxel_MemoryContext_reallocate(hipxel_MemoryContext *mc, void *ptr, size_t size);
+
+void hipxel_MemoryContext_deallocate(void *ptr);
+
+/**
+ * Binds context used by libFLAC allocations made on current thread,
+ * returns previously bound one so it can be restored.
+ */
+hipxel_MemoryContext *hipxel_MemoryContext_bind(hipxel_MemoryContext *mc);
+
+#endif // HIPXEL_ALLOCATOR
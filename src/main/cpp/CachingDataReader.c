@@ -0,0 +1,796 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include "CachingDataReader.h"
+
+#include <android/log.h>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIPXEL_LOG_ERROR(...) \
+    ((void)__android_log_print(ANDROID_LOG_ERROR, "CachingDataReader", __VA_ARGS__))
+
+#define BLOCK_SIZE HIPXEL_CACHINGDATAREADER_BLOCK_SIZE
+
+// version 1 could persist source size taken from a short read, such maps are dropped
+static const char MAP_MAGIC[4] = {'H', 'F', 'C', '2'};
+
+// map file: header, key bytes, then uint32_t length of every block (0 when not cached)
+typedef struct {
+	char magic[4];
+	uint32_t blockSize;
+	int64_t sourceSize;
+	uint32_t blocksCount;
+	uint32_t keyLength;
+} hipxel_CacheMapHeader;
+
+typedef struct {
+	char *stem;
+	int64_t bytes;
+	time_t lastUse;
+} hipxel_ClosedEntry;
+
+// entries in one directory share its budget, closed ones are known from last scan
+typedef struct hipxel_CacheDirectory {
+	struct hipxel_CacheDirectory *next;
+	int refCount;
+
+	char *path;
+	int64_t budgetBytes;
+	hipxel_ClosedEntry *closedEntries;
+	size_t closedCount;
+} hipxel_CacheDirectory;
+
+typedef struct hipxel_CacheEntry {
+	struct hipxel_CacheEntry *next;
+	int refCount;
+	hipxel_CacheDirectory *directory;
+
+	char *key;
+	char *stem;
+	int dataFd;
+	int mapFd;
+
+	int64_t sourceSize;
+	uint32_t blocksCount;
+	uint32_t blocksCapacity;
+	uint32_t *lengths;
+	uint64_t *lastUse;
+	uint32_t *pins;
+	int64_t presentBytes;
+} hipxel_CacheEntry;
+
+typedef struct {
+	hipxel_DataReader upstream;
+	hipxel_CacheEntry *entry;
+	uint8_t *blockBuffer;
+} hipxel_CachingDataReader;
+
+// all state below is shared between readers and guarded by cacheLock
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static hipxel_CacheDirectory *directories = NULL;
+static hipxel_CacheEntry *openEntries = NULL;
+static uint64_t useTick = 0;
+
+static char *joinPath(const char *directory, const char *name, const char *extension) {
+	size_t length = strlen(directory) + strlen(name) + strlen(extension) + 2;
+	char *path = malloc(length);
+	if (NULL != path)
+		snprintf(path, length, "%s/%s%s", directory, name, extension);
+	return path;
+}
+
+static char *withExtension(const char *stem, const char *extension) {
+	size_t length = strlen(stem) + strlen(extension) + 1;
+	char *path = malloc(length);
+	if (NULL != path)
+		snprintf(path, length, "%s%s", stem, extension);
+	return path;
+}
+
+static uint64_t hashKey(const char *key) {
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (const char *c = key; *c; ++c) {
+		h ^= (uint8_t) *c;
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static bool readFully(int fd, void *data, size_t length, off_t offset) {
+	uint8_t *p = (uint8_t *) data;
+	while (length > 0) {
+		ssize_t r = pread(fd, p, length, offset);
+		if (r <= 0)
+			return false;
+		p += r;
+		length -= (size_t) r;
+		offset += r;
+	}
+	return true;
+}
+
+static bool writeFully(int fd, const void *data, size_t length, off_t offset) {
+	const uint8_t *p = (const uint8_t *) data;
+	while (length > 0) {
+		ssize_t w = pwrite(fd, p, length, offset);
+		if (w <= 0)
+			return false;
+		p += w;
+		length -= (size_t) w;
+		offset += w;
+	}
+	return true;
+}
+
+typedef int (*hipxel_Fallocate)(int fd, int mode, off64_t offset, off64_t length);
+
+static bool punchHole(int fd, off_t offset, off_t length) {
+#if defined(__ANDROID_API__) && __ANDROID_API__ < 21
+	// bionic has fallocate64 since API 21, look it up at run time so it's used where present
+	static bool resolved = false;
+	static hipxel_Fallocate fallocateFunction = NULL;
+	if (!resolved) {
+		fallocateFunction = (hipxel_Fallocate) dlsym(RTLD_DEFAULT, "fallocate64");
+		resolved = true;
+	}
+#else
+	hipxel_Fallocate fallocateFunction = fallocate64;
+#endif
+
+	return NULL != fallocateFunction && 0 == fallocateFunction(fd,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+
+static off_t lengthsOffset(hipxel_CacheEntry *e) {
+	return (off_t) (sizeof(hipxel_CacheMapHeader) + strlen(e->key));
+}
+
+static void writeMapHeader(hipxel_CacheEntry *e) {
+	hipxel_CacheMapHeader h;
+	memcpy(h.magic, MAP_MAGIC, sizeof(h.magic));
+	h.blockSize = BLOCK_SIZE;
+	h.sourceSize = e->sourceSize;
+	h.blocksCount = e->blocksCount;
+	h.keyLength = (uint32_t) strlen(e->key);
+
+	if (!writeFully(e->mapFd, &h, sizeof(h), 0))
+		HIPXEL_LOG_ERROR("couldn't write cache map header");
+}
+
+static void writeMapLength(hipxel_CacheEntry *e, uint32_t index) {
+	off_t offset = lengthsOffset(e) + (off_t) index * sizeof(uint32_t);
+	if (!writeFully(e->mapFd, &(e->lengths[index]), sizeof(uint32_t), offset))
+		HIPXEL_LOG_ERROR("couldn't write cache map entry");
+}
+
+static bool ensureBlocksCapacity(hipxel_CacheEntry *e, uint32_t blocksCount) {
+	if (blocksCount <= e->blocksCapacity)
+		return true;
+
+	uint32_t capacity = e->blocksCapacity > 0 ? e->blocksCapacity : 64;
+	while (capacity < blocksCount)
+		capacity *= 2;
+
+	uint32_t *lengths = realloc(e->lengths, capacity * sizeof(uint32_t));
+	if (NULL == lengths)
+		return false;
+	e->lengths = lengths;
+
+	uint64_t *lastUse = realloc(e->lastUse, capacity * sizeof(uint64_t));
+	if (NULL == lastUse)
+		return false;
+	e->lastUse = lastUse;
+
+	uint32_t *pins = realloc(e->pins, capacity * sizeof(uint32_t));
+	if (NULL == pins)
+		return false;
+	e->pins = pins;
+
+	memset(e->lengths + e->blocksCapacity, 0,
+			(capacity - e->blocksCapacity) * sizeof(uint32_t));
+	memset(e->lastUse + e->blocksCapacity, 0,
+			(capacity - e->blocksCapacity) * sizeof(uint64_t));
+	memset(e->pins + e->blocksCapacity, 0,
+			(capacity - e->blocksCapacity) * sizeof(uint32_t));
+	e->blocksCapacity = capacity;
+	return true;
+}
+
+static bool loadMap(hipxel_CacheEntry *e) {
+	hipxel_CacheMapHeader h;
+	if (!readFully(e->mapFd, &h, sizeof(h), 0))
+		return false;
+
+	size_t keyLength = strlen(e->key);
+	if (0 != memcmp(h.magic, MAP_MAGIC, sizeof(h.magic))
+			|| h.blockSize != BLOCK_SIZE || h.keyLength != keyLength)
+		return false;
+
+	char *key = malloc(keyLength + 1);
+	if (NULL == key)
+		return false;
+
+	bool sameKey = readFully(e->mapFd, key, keyLength, sizeof(h))
+			&& 0 == memcmp(key, e->key, keyLength);
+	free(key);
+	if (!sameKey)
+		return false;
+
+	if (!ensureBlocksCapacity(e, h.blocksCount))
+		return false;
+
+	if (h.blocksCount > 0 && !readFully(e->mapFd, e->lengths,
+			h.blocksCount * sizeof(uint32_t), lengthsOffset(e)))
+		return false;
+
+	e->sourceSize = h.sourceSize;
+	e->blocksCount = h.blocksCount;
+	e->presentBytes = 0;
+	for (uint32_t i = 0; i < e->blocksCount; ++i) {
+		if (e->lengths[i] > BLOCK_SIZE)
+			e->lengths[i] = 0;
+		e->presentBytes += e->lengths[i];
+	}
+	return true;
+}
+
+static void resetMap(hipxel_CacheEntry *e) {
+	if (0 != ftruncate(e->dataFd, 0) || 0 != ftruncate(e->mapFd, 0))
+		HIPXEL_LOG_ERROR("couldn't truncate cache entry");
+
+	e->sourceSize = -1;
+	e->blocksCount = 0;
+	e->presentBytes = 0;
+	if (e->blocksCapacity > 0)
+		memset(e->lengths, 0, e->blocksCapacity * sizeof(uint32_t));
+
+	writeMapHeader(e);
+	if (!writeFully(e->mapFd, e->key, strlen(e->key), sizeof(hipxel_CacheMapHeader)))
+		HIPXEL_LOG_ERROR("couldn't write cache map key");
+}
+
+// returns false if block is forgotten but its space couldn't be given back
+static bool evictBlock(hipxel_CacheEntry *e, uint32_t index) {
+	bool punched = punchHole(e->dataFd, (off_t) index * BLOCK_SIZE, BLOCK_SIZE);
+
+	e->presentBytes -= e->lengths[index];
+	e->lengths[index] = 0;
+	writeMapLength(e, index);
+	return punched;
+}
+
+// without hole punching only truncating whole data file frees space
+static void evictEntryData(hipxel_CacheEntry *e) {
+	for (uint32_t i = 0; i < e->blocksCount; ++i) {
+		if (e->pins[i] > 0)
+			return;
+	}
+
+	if (0 != ftruncate(e->dataFd, 0))
+		HIPXEL_LOG_ERROR("couldn't truncate cache entry data");
+
+	for (uint32_t i = 0; i < e->blocksCount; ++i) {
+		if (e->lengths[i] > 0) {
+			e->lengths[i] = 0;
+			writeMapLength(e, i);
+		}
+	}
+	e->presentBytes = 0;
+}
+
+static void deleteClosedEntry(hipxel_CacheDirectory *d, size_t index) {
+	hipxel_ClosedEntry *c = &(d->closedEntries[index]);
+	char *dataPath = withExtension(c->stem, ".data");
+	char *mapPath = withExtension(c->stem, ".map");
+
+	// drop map first, data without map is never trusted
+	if (NULL != mapPath)
+		unlink(mapPath);
+	if (NULL != dataPath)
+		unlink(dataPath);
+
+	free(mapPath);
+	free(dataPath);
+	free(c->stem);
+
+	memmove(d->closedEntries + index, d->closedEntries + index + 1,
+			(d->closedCount - index - 1) * sizeof(hipxel_ClosedEntry));
+	--(d->closedCount);
+}
+
+static bool addClosedEntry(hipxel_CacheDirectory *d, char *stem, int64_t bytes, time_t lastUse) {
+	hipxel_ClosedEntry *entries = realloc(d->closedEntries,
+			(d->closedCount + 1) * sizeof(hipxel_ClosedEntry));
+	if (NULL == entries)
+		return false;
+	d->closedEntries = entries;
+
+	d->closedEntries[d->closedCount].stem = stem;
+	d->closedEntries[d->closedCount].bytes = bytes;
+	d->closedEntries[d->closedCount].lastUse = lastUse;
+	++(d->closedCount);
+	return true;
+}
+
+static bool isOpen(const char *stem) {
+	for (hipxel_CacheEntry *e = openEntries; NULL != e; e = e->next) {
+		if (0 == strcmp(e->stem, stem))
+			return true;
+	}
+	return false;
+}
+
+static int compareClosedEntries(const void *a, const void *b) {
+	time_t ta = ((const hipxel_ClosedEntry *) a)->lastUse;
+	time_t tb = ((const hipxel_ClosedEntry *) b)->lastUse;
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+static void scanDirectory(hipxel_CacheDirectory *d) {
+	while (d->closedCount > 0)
+		free(d->closedEntries[--(d->closedCount)].stem);
+
+	const char *directory = d->path;
+	DIR *dir = opendir(directory);
+	if (NULL == dir)
+		return;
+
+	struct dirent *de;
+	while (NULL != (de = readdir(dir))) {
+		size_t nameLength = strlen(de->d_name);
+		if (nameLength <= 4 || 0 != strcmp(de->d_name + nameLength - 4, ".map"))
+			continue;
+
+		char *stem = joinPath(directory, de->d_name, "");
+		if (NULL == stem)
+			continue;
+		stem[strlen(stem) - 4] = 0;
+
+		if (isOpen(stem)) {
+			free(stem);
+			continue;
+		}
+
+		char *dataPath = withExtension(stem, ".data");
+		char *mapPath = withExtension(stem, ".map");
+		struct stat dataStat, mapStat;
+
+		bool ok = NULL != dataPath && NULL != mapPath
+				&& 0 == stat(mapPath, &mapStat)
+				&& 0 == stat(dataPath, &dataStat)
+				&& addClosedEntry(d, stem, (int64_t) dataStat.st_blocks * 512, mapStat.st_mtime);
+
+		free(dataPath);
+		free(mapPath);
+		if (!ok)
+			free(stem);
+	}
+	closedir(dir);
+
+	if (d->closedCount > 1)
+		qsort(d->closedEntries, d->closedCount, sizeof(hipxel_ClosedEntry),
+				compareClosedEntries);
+}
+
+static int64_t getUsedBytes(hipxel_CacheDirectory *d) {
+	int64_t used = 0;
+	for (size_t i = 0; i < d->closedCount; ++i)
+		used += d->closedEntries[i].bytes;
+	for (hipxel_CacheEntry *e = openEntries; NULL != e; e = e->next) {
+		if (e->directory == d)
+			used += e->presentBytes;
+	}
+	return used;
+}
+
+static void enforceBudget(hipxel_CacheDirectory *d, hipxel_CacheEntry *keepEntry,
+                          uint32_t keepIndex) {
+	while (getUsedBytes(d) > d->budgetBytes) {
+		// closed entries weren't used in this session, so they go first
+		if (d->closedCount > 0) {
+			deleteClosedEntry(d, 0);
+			continue;
+		}
+
+		hipxel_CacheEntry *victim = NULL;
+		uint32_t victimIndex = 0;
+		for (hipxel_CacheEntry *e = openEntries; NULL != e; e = e->next) {
+			if (e->directory != d)
+				continue;
+
+			for (uint32_t i = 0; i < e->blocksCount; ++i) {
+				// pinned blocks are being read outside of cacheLock
+				if (e->lengths[i] == 0 || e->pins[i] > 0 || (e == keepEntry && i == keepIndex))
+					continue;
+
+				if (NULL == victim || e->lastUse[i] < victim->lastUse[victimIndex]) {
+					victim = e;
+					victimIndex = i;
+				}
+			}
+		}
+
+		if (NULL == victim)
+			return;
+
+		if (!evictBlock(victim, victimIndex))
+			evictEntryData(victim);
+	}
+}
+
+static void freeEntry(hipxel_CacheEntry *e) {
+	if (e->dataFd >= 0)
+		close(e->dataFd);
+	if (e->mapFd >= 0)
+		close(e->mapFd);
+
+	free(e->lengths);
+	free(e->lastUse);
+	free(e->pins);
+	free(e->stem);
+	free(e->key);
+	free(e);
+}
+
+static hipxel_CacheEntry *openEntry(const char *directory, const char *key) {
+	hipxel_CacheEntry *e = calloc(1, sizeof(hipxel_CacheEntry));
+	if (NULL == e)
+		return NULL;
+
+	e->dataFd = -1;
+	e->mapFd = -1;
+	e->sourceSize = -1;
+
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long) hashKey(key));
+
+	e->key = strdup(key);
+	e->stem = joinPath(directory, name, "");
+	char *dataPath = joinPath(directory, name, ".data");
+	char *mapPath = joinPath(directory, name, ".map");
+
+	if (NULL != e->key && NULL != e->stem && NULL != dataPath && NULL != mapPath) {
+		e->dataFd = open(dataPath, O_RDWR | O_CREAT, 0600);
+		e->mapFd = open(mapPath, O_RDWR | O_CREAT, 0600);
+	}
+
+	free(dataPath);
+	free(mapPath);
+
+	if (e->dataFd < 0 || e->mapFd < 0) {
+		HIPXEL_LOG_ERROR("couldn't open cache entry in %s", directory);
+		freeEntry(e);
+		return NULL;
+	}
+
+	if (!loadMap(e))
+		resetMap(e);
+
+	return e;
+}
+
+static hipxel_CacheDirectory *acquireDirectory(const char *path) {
+	hipxel_CacheDirectory *d = directories;
+	while (NULL != d && 0 != strcmp(d->path, path))
+		d = d->next;
+
+	if (NULL != d) {
+		++(d->refCount);
+		return d;
+	}
+
+	d = calloc(1, sizeof(hipxel_CacheDirectory));
+	if (NULL == d)
+		return NULL;
+
+	d->path = strdup(path);
+	if (NULL == d->path) {
+		free(d);
+		return NULL;
+	}
+
+	d->refCount = 1;
+	d->next = directories;
+	directories = d;
+	return d;
+}
+
+static void releaseDirectory(hipxel_CacheDirectory *d) {
+	if (--(d->refCount) > 0)
+		return;
+
+	hipxel_CacheDirectory **link = &directories;
+	while (*link != d)
+		link = &((*link)->next);
+	*link = d->next;
+
+	while (d->closedCount > 0)
+		free(d->closedEntries[--(d->closedCount)].stem);
+	free(d->closedEntries);
+	free(d->path);
+	free(d);
+}
+
+static hipxel_CacheEntry *acquireEntry(const char *directory, const char *key,
+                                       int64_t budget) {
+	pthread_mutex_lock(&cacheLock);
+
+	hipxel_CacheDirectory *d = acquireDirectory(directory);
+	if (NULL == d) {
+		pthread_mutex_unlock(&cacheLock);
+		return NULL;
+	}
+
+	// latest budget given for directory applies to all its entries
+	d->budgetBytes = budget;
+
+	hipxel_CacheEntry *e = openEntries;
+	while (NULL != e && (e->directory != d || 0 != strcmp(e->key, key)))
+		e = e->next;
+
+	if (NULL != e) {
+		++(e->refCount);
+		releaseDirectory(d);
+	} else {
+		e = openEntry(directory, key);
+		if (NULL != e) {
+			e->refCount = 1;
+			e->directory = d;
+			e->next = openEntries;
+			openEntries = e;
+
+			scanDirectory(d);
+			enforceBudget(d, NULL, 0);
+		} else {
+			releaseDirectory(d);
+		}
+	}
+
+	pthread_mutex_unlock(&cacheLock);
+	return e;
+}
+
+static void releaseEntry(hipxel_CacheEntry *e) {
+	pthread_mutex_lock(&cacheLock);
+
+	if (--(e->refCount) <= 0) {
+		hipxel_CacheEntry **link = &openEntries;
+		while (*link != e)
+			link = &((*link)->next);
+		*link = e->next;
+
+		// touches map, so its mtime tells when entry was used last time
+		writeMapHeader(e);
+
+		hipxel_CacheDirectory *d = e->directory;
+		int64_t bytes = e->presentBytes;
+		char *stem = e->stem;
+		e->stem = NULL;
+		if (!addClosedEntry(d, stem, bytes, time(NULL)))
+			free(stem);
+
+		freeEntry(e);
+		releaseDirectory(d);
+	}
+
+	pthread_mutex_unlock(&cacheLock);
+}
+
+// copies cached part of block, returns -1 if block isn't cached
+static int64_t readCached(hipxel_CacheEntry *e, uint32_t index, int64_t offset,
+                          int64_t length, uint8_t *buffer) {
+	int64_t n = -1;
+
+	pthread_mutex_lock(&cacheLock);
+	if (index < e->blocksCount && e->lengths[index] > 0) {
+		int64_t available = e->lengths[index] - offset;
+		n = available < length ? available : length;
+		if (n > 0) {
+			e->lastUse[index] = ++useTick;
+			++(e->pins[index]);
+		} else {
+			n = 0;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+
+	if (n <= 0)
+		return n;
+
+	// disk read doesn't hold cacheLock, pin keeps block from being evicted meanwhile
+	bool ok = readFully(e->dataFd, buffer, (size_t) n,
+			(off_t) index * BLOCK_SIZE + (off_t) offset);
+
+	pthread_mutex_lock(&cacheLock);
+	--(e->pins[index]);
+	if (!ok && e->lengths[index] > 0 && e->pins[index] == 0)
+		evictBlock(e, index);
+	pthread_mutex_unlock(&cacheLock);
+
+	return ok ? n : -1;
+}
+
+static int64_t fetchBlock(hipxel_CachingDataReader *cdr, uint32_t index) {
+	hipxel_DataReader *upstream = &(cdr->upstream);
+	int64_t start = (int64_t) index * BLOCK_SIZE;
+	int64_t got = 0;
+
+	while (got < BLOCK_SIZE) {
+		int64_t r = upstream->read(upstream->p, start + got, BLOCK_SIZE - got,
+				cdr->blockBuffer + got);
+		if (r < 0)
+			return r;
+		if (r == 0)
+			break;
+		got += r;
+	}
+
+	return got;
+}
+
+static void storeBlock(hipxel_CacheEntry *e, uint32_t index, const uint8_t *data,
+                       int64_t length) {
+	pthread_mutex_lock(&cacheLock);
+	bool pinned = ensureBlocksCapacity(e, index + 1);
+	if (pinned)
+		++(e->pins[index]);
+	pthread_mutex_unlock(&cacheLock);
+
+	if (!pinned)
+		return;
+
+	// data goes first, block becomes visible only after it's fully written,
+	// pin keeps concurrent eviction from punching hole under it meanwhile
+	bool ok = writeFully(e->dataFd, data, (size_t) length, (off_t) index * BLOCK_SIZE);
+
+	pthread_mutex_lock(&cacheLock);
+
+	--(e->pins[index]);
+	if (ok) {
+		if (index >= e->blocksCount) {
+			e->blocksCount = index + 1;
+			writeMapHeader(e);
+		}
+
+		e->presentBytes += length - e->lengths[index];
+		e->lengths[index] = (uint32_t) length;
+		e->lastUse[index] = ++useTick;
+		writeMapLength(e, index);
+
+		enforceBudget(e->directory, e, index);
+	}
+
+	pthread_mutex_unlock(&cacheLock);
+}
+
+static int64_t cdr_getSize(void *p);
+
+static int64_t readBlock(hipxel_CachingDataReader *cdr, uint32_t index, int64_t offset,
+                         int64_t length, uint8_t *buffer) {
+	int64_t cached = readCached(cdr->entry, index, offset, length, buffer);
+	if (cached >= 0)
+		return cached;
+
+	int64_t got = fetchBlock(cdr, index);
+	if (got <= 0)
+		return got;
+
+	// short read of progressive or unknown size source may only mean data isn't there yet,
+	// so short block is cached only when it's known to be the last one
+	int64_t size = got < BLOCK_SIZE ? cdr_getSize(cdr) : -1;
+	if (got == BLOCK_SIZE || (size >= 0 && (int64_t) index * BLOCK_SIZE + got >= size))
+		storeBlock(cdr->entry, index, cdr->blockBuffer, got);
+
+	int64_t available = got - offset;
+	int64_t n = available < length ? available : length;
+	if (n <= 0)
+		return 0;
+
+	memcpy(buffer, cdr->blockBuffer + offset, (size_t) n);
+	return n;
+}
+
+static int64_t cdr_read(void *p, int64_t position, int64_t length, void *buffer) {
+	hipxel_CachingDataReader *cdr = (hipxel_CachingDataReader *) p;
+	uint8_t *dst = (uint8_t *) buffer;
+	int64_t done = 0;
+
+	while (done < length) {
+		int64_t pos = position + done;
+		int64_t got = readBlock(cdr, (uint32_t) (pos / BLOCK_SIZE), pos % BLOCK_SIZE,
+				length - done, dst + done);
+
+		if (got < 0)
+			return done > 0 ? done : got;
+		if (got == 0)
+			break;
+		done += got;
+	}
+
+	return done;
+}
+
+static int64_t cdr_getSize(void *p) {
+	hipxel_CachingDataReader *cdr = (hipxel_CachingDataReader *) p;
+	hipxel_CacheEntry *e = cdr->entry;
+
+	pthread_mutex_lock(&cacheLock);
+	int64_t size = e->sourceSize;
+	pthread_mutex_unlock(&cacheLock);
+
+	if (size >= 0)
+		return size;
+
+	size = cdr->upstream.getSize(cdr->upstream.p);
+	if (size >= 0) {
+		pthread_mutex_lock(&cacheLock);
+		e->sourceSize = size;
+		writeMapHeader(e);
+		pthread_mutex_unlock(&cacheLock);
+	}
+	return size;
+}
+
+static void cdr_release(void *p) {
+	hipxel_CachingDataReader *cdr = (hipxel_CachingDataReader *) p;
+
+	releaseEntry(cdr->entry);
+	cdr->upstream.release(cdr->upstream.p);
+
+	free(cdr->blockBuffer);
+	free(cdr);
+}
+
+hipxel_DataReader hipxel_CachingDataReader_create(hipxel_DataReader upstream,
+		const char *directory, const char *key, int64_t budgetBytes) {
+	hipxel_CachingDataReader *cdr = malloc(sizeof(hipxel_CachingDataReader));
+	if (NULL == cdr)
+		return upstream;
+
+	cdr->upstream = upstream;
+	cdr->blockBuffer = malloc(BLOCK_SIZE);
+	cdr->entry = NULL;
+
+	if (NULL != cdr->blockBuffer)
+		cdr->entry = acquireEntry(directory, key, budgetBytes);
+
+	if (NULL == cdr->entry) {
+		free(cdr->blockBuffer);
+		free(cdr);
+		return upstream;
+	}
+
+	hipxel_DataReader v;
+	v.read = cdr_read;
+	v.getSize = cdr_getSize;
+	v.release = cdr_release;
+	v.p = cdr;
+	return v;
+}
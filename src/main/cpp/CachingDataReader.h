@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_CACHINGDATAREADER
+#define HIPXEL_CACHINGDATAREADER
+
+#include "DataReader.h"
+
+#define HIPXEL_CACHINGDATAREADER_BLOCK_SIZE (64 * 1024)
+
+/**
+ * Wraps upstream reader with sparse on-disk cache kept in directory under given key.
+ * Fetched blocks survive between sessions, all cache entries in directory share
+ * budgetBytes and least recently used blocks (or whole closed entries) are evicted first.
+ * Returns upstream unchanged if cache files can't be opened.
+ */
+hipxel_DataReader hipxel_CachingDataReader_create(hipxel_DataReader upstream,
+		const char *directory, const char *key, int64_t budgetBytes);
+
+#endif // HIPXEL_CACHINGDATAREADER
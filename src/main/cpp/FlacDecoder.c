@@ -16,36 +16,204 @@
 
 #include "FlacDecoder.h"
 
+#include "FramePipeline.h"
+
 #include "GrowingBuffer.h"
 
 #include <FLAC/stream_decoder.h>
 
 #include <android/log.h>
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #define HIPXEL_LOG_ERROR(...) \
     ((void)__android_log_print(ANDROID_LOG_ERROR, "FlacDecoder", __VA_ARGS__))
 
+typedef int32_t hipxel_v4i __attribute__((vector_size(16)));
+typedef uint32_t hipxel_v4u __attribute__((vector_size(16)));
+typedef int16_t hipxel_v4s __attribute__((vector_size(8)));
+typedef int16_t hipxel_v8s __attribute__((vector_size(16)));
+typedef float hipxel_v4f __attribute__((vector_size(16)));
+
+static inline hipxel_v4i loadInts(const FLAC__int32 *src) {
+	hipxel_v4i v;
+	memcpy(&v, src, sizeof(v));
+	return v;
+}
+
 static inline void leftShiftCopy(int16_t *dst, const FLAC__int32 *const buffer[],
-                                 unsigned int framesCount, unsigned int channelsCount,
-                                 unsigned int bitShift) {
+                                 unsigned int framesCount, const uint32_t *channelMap,
+                                 unsigned int channelsCount, unsigned int bitShift,
+                                 bool reversed) {
 	for (unsigned int i = 0; i < framesCount; ++i) {
+		unsigned int s = reversed ? framesCount - 1 - i : i;
 		for (unsigned int c = 0; c < channelsCount; ++c) {
-			*dst++ = (int16_t) (buffer[c][i] << bitShift);
+			*dst++ = (int16_t) (buffer[channelMap[c]][s] << bitShift);
 		}
 	}
 }
 
 static inline void rightShiftCopy(int16_t *dst, const FLAC__int32 *const buffer[],
-                                  unsigned int framesCount, unsigned int channelsCount,
-                                  unsigned int bitShift) {
+                                  unsigned int framesCount, const uint32_t *channelMap,
+                                  unsigned int channelsCount, unsigned int bitShift,
+                                  bool reversed) {
+	for (unsigned int i = 0; i < framesCount; ++i) {
+		unsigned int s = reversed ? framesCount - 1 - i : i;
+		for (unsigned int c = 0; c < channelsCount; ++c) {
+			*dst++ = (int16_t) (buffer[channelMap[c]][s] >> bitShift);
+		}
+	}
+}
+
+// 32-bit output is left aligned, so full scale doesn't depend on bits per sample
+static inline void int32Copy(int32_t *dst, const FLAC__int32 *const buffer[],
+                             unsigned int framesCount, const uint32_t *channelMap,
+                             unsigned int channelsCount, unsigned int bitShift,
+                             bool reversed) {
+	for (unsigned int i = 0; i < framesCount; ++i) {
+		unsigned int s = reversed ? framesCount - 1 - i : i;
+		for (unsigned int c = 0; c < channelsCount; ++c) {
+			*dst++ = (int32_t) ((uint32_t) buffer[channelMap[c]][s] << bitShift);
+		}
+	}
+}
+
+static inline void floatCopy(float *dst, const FLAC__int32 *const buffer[],
+                             unsigned int framesCount, const uint32_t *channelMap,
+                             unsigned int channelsCount, float scale,
+                             bool reversed) {
 	for (unsigned int i = 0; i < framesCount; ++i) {
+		unsigned int s = reversed ? framesCount - 1 - i : i;
 		for (unsigned int c = 0; c < channelsCount; ++c) {
-			*dst++ = (int16_t) (buffer[c][i] >> bitShift);
+			*dst++ = (float) buffer[channelMap[c]][s] * scale;
+		}
+	}
+}
+
+/**
+ * Stereo kernels shift or scale and interleave four frames per iteration, negative
+ * bitShift shifts right. Remaining frames and reversed frames go through generic copies.
+ */
+static inline unsigned int interleaveStereoInt16(int16_t *dst, const FLAC__int32 *left,
+                                                 const FLAC__int32 *right,
+                                                 unsigned int framesCount, int bitShift) {
+	unsigned int i = 0;
+	for (; i + 4 <= framesCount; i += 4) {
+		hipxel_v4i l = loadInts(left + i);
+		hipxel_v4i r = loadInts(right + i);
+		if (bitShift >= 0) {
+			l <<= bitShift;
+			r <<= bitShift;
+		} else {
+			l >>= -bitShift;
+			r >>= -bitShift;
 		}
+
+		hipxel_v8s lr = __builtin_shufflevector(__builtin_convertvector(l, hipxel_v4s),
+				__builtin_convertvector(r, hipxel_v4s), 0, 4, 1, 5, 2, 6, 3, 7);
+		memcpy(dst + 2 * i, &lr, sizeof(lr));
 	}
+	return i;
+}
+
+static inline unsigned int interleaveStereoInt32(int32_t *dst, const FLAC__int32 *left,
+                                                 const FLAC__int32 *right,
+                                                 unsigned int framesCount,
+                                                 unsigned int bitShift) {
+	unsigned int i = 0;
+	for (; i + 4 <= framesCount; i += 4) {
+		hipxel_v4i l = (hipxel_v4i) ((hipxel_v4u) loadInts(left + i) << bitShift);
+		hipxel_v4i r = (hipxel_v4i) ((hipxel_v4u) loadInts(right + i) << bitShift);
+
+		hipxel_v4i lo = __builtin_shufflevector(l, r, 0, 4, 1, 5);
+		hipxel_v4i hi = __builtin_shufflevector(l, r, 2, 6, 3, 7);
+		memcpy(dst + 2 * i, &lo, sizeof(lo));
+		memcpy(dst + 2 * i + 4, &hi, sizeof(hi));
+	}
+	return i;
+}
+
+static inline unsigned int interleaveStereoFloat(float *dst, const FLAC__int32 *left,
+                                                 const FLAC__int32 *right,
+                                                 unsigned int framesCount, float scale) {
+	hipxel_v4f s = {scale, scale, scale, scale};
+	unsigned int i = 0;
+	for (; i + 4 <= framesCount; i += 4) {
+		hipxel_v4f l = __builtin_convertvector(loadInts(left + i), hipxel_v4f) * s;
+		hipxel_v4f r = __builtin_convertvector(loadInts(right + i), hipxel_v4f) * s;
+
+		hipxel_v4f lo = __builtin_shufflevector(l, r, 0, 4, 1, 5);
+		hipxel_v4f hi = __builtin_shufflevector(l, r, 2, 6, 3, 7);
+		memcpy(dst + 2 * i, &lo, sizeof(lo));
+		memcpy(dst + 2 * i + 4, &hi, sizeof(hi));
+	}
+	return i;
+}
+
+static inline int16_t clampToInt16(float v) {
+	if (v >= 32767.0f)
+		return 32767;
+	if (v <= -32768.0f)
+		return -32768;
+	return (int16_t) (v < 0.0f ? v - 0.5f : v + 0.5f);
+}
+
+static inline int32_t clampToInt32(float v) {
+	if (v >= 2147483648.0f)
+		return INT32_MAX;
+	if (v <= -2147483648.0f)
+		return INT32_MIN;
+	return (int32_t) (v < 0.0f ? v - 0.5f : v + 0.5f);
+}
+
+// matrix is scaled to 16-bit range, other formats are rescaled while storing
+static inline void mixCopy(void *dst, int format, const FLAC__int32 *const buffer[],
+                           unsigned int framesCount, unsigned int channelsCount,
+                           unsigned int outputChannelsCount, const float *matrix,
+                           bool reversed) {
+	int16_t *dst16 = (int16_t *) dst;
+	int32_t *dst32 = (int32_t *) dst;
+	float *dstFloat = (float *) dst;
+
+	for (unsigned int i = 0; i < framesCount; ++i) {
+		unsigned int s = reversed ? framesCount - 1 - i : i;
+		const float *row = matrix;
+		for (unsigned int o = 0; o < outputChannelsCount; ++o) {
+			float acc = 0.0f;
+			for (unsigned int c = 0; c < channelsCount; ++c)
+				acc += row[c] * (float) buffer[c][s];
+			row += channelsCount;
+
+			if (format == HIPXEL_FORMAT_FLOAT)
+				*dstFloat++ = acc * (1.0f / 32768.0f);
+			else if (format == HIPXEL_FORMAT_S32)
+				*dst32++ = clampToInt32(acc * 65536.0f);
+			else
+				*dst16++ = clampToInt16(acc);
+		}
+	}
+}
+
+static inline void crossFade(int16_t *dst, const int16_t *from, const int16_t *to,
+                             unsigned int framesCount, unsigned int channelsCount) {
+	for (unsigned int i = 0; i < framesCount; ++i) {
+		int32_t w = (int32_t) (((2 * i + 1) << 15) / (2 * framesCount));
+		for (unsigned int c = 0; c < channelsCount; ++c) {
+			*dst++ = (int16_t) ((*from++ * (32768 - w) + *to++ * w) >> 15);
+		}
+	}
+}
+
+static inline int64_t sampleSize(int format) {
+	return format == HIPXEL_FORMAT_S16 ? sizeof(int16_t)
+			: format == HIPXEL_FORMAT_S32 ? sizeof(int32_t) : sizeof(float);
+}
+
+static inline int64_t outputFrameSize(hipxel_FlacDecoder *fd) {
+	return fd->output.channelsCount * sampleSize(fd->output.format);
 }
 
 static FLAC__StreamDecoderReadStatus readCallback(
@@ -70,6 +238,7 @@ static FLAC__StreamDecoderReadStatus readCallback(
 
 	*bytes = (size_t) got;
 	fd->currentOffset += got;
+	fd->bytesRead += got;
 	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
@@ -118,6 +287,89 @@ static FLAC__bool eofCallback(
 	return fd->endOfFile;
 }
 
+// feeds analyzer and converts decoded frame into output buffer
+static FLAC__StreamDecoderWriteStatus writeSamples(hipxel_FlacDecoder *fd,
+                                                   const FLAC__int32 *const buffer[],
+                                                   unsigned framesCount, bool reversed) {
+	uint32_t channelsCount = fd->info.channelsCount;
+	uint32_t outputChannelsCount = fd->output.channelsCount;
+
+	if (NULL != fd->analysis.analyzer && !reversed && fd->scrub.speed == 0.0f) {
+		hipxel_LoudnessAnalyzer_process(fd->analysis.analyzer, buffer, framesCount);
+
+		if (fd->analysis.analyzeOnly) {
+			fd->bytesWrittenSinceRequest += framesCount * outputFrameSize(fd);
+			return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+		}
+	}
+
+	uint64_t bytesCount = framesCount * outputFrameSize(fd);
+
+	void *p = hipxel_GrowingBuffer_claimForWrite(fd->writeBuffer, bytesCount);
+	if (bytesCount > 0 && (NULL == p))
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+	int format = fd->output.format;
+
+	if (fd->output.mixing) {
+		mixCopy(p, format, buffer, framesCount, channelsCount, outputChannelsCount,
+				fd->output.scaledMatrix, reversed);
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	const uint32_t *channelMap = fd->output.channelMap;
+	int bitsPerSample = (int) fd->info.bitsPerSample;
+	float scale = 1.0f / (float) (1u << (bitsPerSample - 1));
+
+	// stereo is shifted or scaled and interleaved in one vector pass, generic copy finishes
+	// the rest. Stereo decorrelation is done before this, in libFLAC's own pass
+	unsigned int done = 0;
+	if (outputChannelsCount == 2 && !reversed) {
+		const FLAC__int32 *left = buffer[channelMap[0]];
+		const FLAC__int32 *right = buffer[channelMap[1]];
+
+		if (format == HIPXEL_FORMAT_S16)
+			done = interleaveStereoInt16(p, left, right, framesCount, 16 - bitsPerSample);
+		else if (format == HIPXEL_FORMAT_S32)
+			done = interleaveStereoInt32(p, left, right, framesCount,
+					(unsigned) (32 - bitsPerSample));
+		else
+			done = interleaveStereoFloat(p, left, right, framesCount, scale);
+	}
+
+	const FLAC__int32 *rest[HIPXEL_FLACDECODER_MAX_CHANNELS];
+	for (uint32_t c = 0; c < channelsCount; ++c)
+		rest[c] = buffer[c] + done;
+
+	unsigned int restCount = framesCount - done;
+	int64_t offset = done * outputFrameSize(fd);
+
+	if (format == HIPXEL_FORMAT_S32) {
+		int32Copy((int32_t *) ((uint8_t *) p + offset), rest, restCount, channelMap,
+				outputChannelsCount, (unsigned) (32 - bitsPerSample), reversed);
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	if (format == HIPXEL_FORMAT_FLOAT) {
+		floatCopy((float *) ((uint8_t *) p + offset), rest, restCount, channelMap,
+				outputChannelsCount, scale, reversed);
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	// 16 bits is what most of android audio stack works with
+	int16_t *p16 = (int16_t *) ((uint8_t *) p + offset);
+	int needLeftShift = 16 - bitsPerSample;
+	if (needLeftShift >= 0) {
+		leftShiftCopy(p16, rest, restCount, channelMap,
+				outputChannelsCount, (unsigned) needLeftShift, reversed);
+	} else {
+		rightShiftCopy(p16, rest, restCount, channelMap,
+				outputChannelsCount, (unsigned) (-needLeftShift), reversed);
+	}
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
 static FLAC__StreamDecoderWriteStatus writeCallback(
 		const FLAC__StreamDecoder *decoder,
 		const FLAC__Frame *frame, const FLAC__int32 *const buffer[],
@@ -126,23 +378,103 @@ static FLAC__StreamDecoderWriteStatus writeCallback(
 
 	fd->calledWrite = true;
 
-	uint32_t channelsCount = fd->info.channelsCount;
 	unsigned framesCount = frame->header.blocksize;
-	uint64_t bytesCount = framesCount * channelsCount * sizeof(int16_t);
 
-	int16_t *p = (int16_t *) hipxel_GrowingBuffer_claimForWrite(fd->growingBuffer, bytesCount);
-	if (bytesCount > 0 && (NULL == p))
-		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	bool reversed = fd->reverse.enabled;
+	if (reversed) {
+		// flush may let libFLAC resync on different frame than the one located
+		int64_t sampleNumber = (int64_t) frame->header.number.sample_number;
+		if (sampleNumber != fd->reverse.frame.sampleNumber) {
+			HIPXEL_LOG_ERROR("reverse decode got unexpected frame");
+			return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+		}
 
-	// output 16 bits as most of android audio stack works with it
-	int needLeftShift = 16 - fd->info.bitsPerSample;
-	if (needLeftShift >= 0) {
-		leftShiftCopy(p, buffer, framesCount, channelsCount, (unsigned) needLeftShift);
-	} else {
-		rightShiftCopy(p, buffer, framesCount, channelsCount, (unsigned) (-needLeftShift));
+		// only part before position where reverse read started
+		int64_t available = fd->reverse.endSample - sampleNumber;
+		if (available < framesCount)
+			framesCount = (unsigned) (available < 0 ? 0 : available);
 	}
 
-	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	return writeSamples(fd, buffer, framesCount, reversed);
+}
+
+static void readStreamInfo(hipxel_FlacDecoder *fd, const FLAC__StreamMetadata_StreamInfo *i) {
+	if (fd->gotStreamInfo)
+		return;
+
+	fd->info.totalSamplesCount = i->total_samples;
+	fd->info.minBlockSize = i->min_blocksize;
+	fd->info.maxBlockSize = i->max_blocksize;
+	fd->info.maxFrameSize = i->max_framesize;
+	fd->info.sampleRate = i->sample_rate;
+	fd->info.channelsCount = i->channels;
+	fd->info.bitsPerSample = i->bits_per_sample;
+
+	fd->gotStreamInfo = true;
+}
+
+static bool parseTag(const FLAC__StreamMetadata_VorbisComment_Entry *entry,
+                     const char *name, float *outValue) {
+	size_t nameLength = strlen(name);
+	if (entry->length <= nameLength || entry->entry[nameLength] != '=')
+		return false;
+
+	if (0 != strncasecmp((const char *) entry->entry, name, nameLength))
+		return false;
+
+	char value[32];
+	size_t valueLength = entry->length - nameLength - 1;
+	if (valueLength >= sizeof(value))
+		valueLength = sizeof(value) - 1;
+	memcpy(value, entry->entry + nameLength + 1, valueLength);
+	value[valueLength] = 0;
+
+	char *end = NULL;
+	float v = strtof(value, &end);
+	if (end == value)
+		return false;
+
+	*outValue = v;
+	return true;
+}
+
+static void readVorbisComment(hipxel_FlacDecoder *fd,
+                              const FLAC__StreamMetadata_VorbisComment *vc) {
+	for (FLAC__uint32 i = 0; i < vc->num_comments; ++i) {
+		const FLAC__StreamMetadata_VorbisComment_Entry *e = &(vc->comments[i]);
+
+		if (parseTag(e, "REPLAYGAIN_TRACK_GAIN", &(fd->replayGain.trackGainDb)))
+			fd->replayGain.hasTrackGain = true;
+		if (parseTag(e, "REPLAYGAIN_ALBUM_GAIN", &(fd->replayGain.albumGainDb)))
+			fd->replayGain.hasAlbumGain = true;
+
+		parseTag(e, "REPLAYGAIN_TRACK_PEAK", &(fd->replayGain.trackPeak));
+		parseTag(e, "REPLAYGAIN_ALBUM_PEAK", &(fd->replayGain.albumPeak));
+	}
+}
+
+static void readSeekTable(hipxel_FlacDecoder *fd, const FLAC__StreamMetadata_SeekTable *st) {
+	if (st->num_points == 0)
+		return;
+
+	hipxel_SeekPoint *points = hipxel_MemoryContext_allocate(&(fd->memory),
+			st->num_points * sizeof(hipxel_SeekPoint));
+	if (NULL == points)
+		return;
+
+	uint32_t count = 0;
+	for (unsigned i = 0; i < st->num_points; ++i) {
+		const FLAC__StreamMetadata_SeekPoint *sp = &(st->points[i]);
+		if (sp->sample_number == FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER)
+			continue;
+
+		points[count].sampleNumber = (int64_t) sp->sample_number;
+		points[count].offset = (int64_t) sp->stream_offset;
+		++count;
+	}
+
+	hipxel_FrameScanner_setSeekPoints(&(fd->scanner), points, count);
+	hipxel_MemoryContext_deallocate(points);
 }
 
 static void metadataCallback(
@@ -151,22 +483,76 @@ static void metadataCallback(
 		void *client_data) {
 	hipxel_FlacDecoder *fd = (hipxel_FlacDecoder *) client_data;
 
-	if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO) {
-		HIPXEL_LOG_ERROR("excessive STREAMINFO, type: %d", (int) metadata->type);
-		return;
+	switch (metadata->type) {
+		case FLAC__METADATA_TYPE_STREAMINFO:
+			readStreamInfo(fd, &(metadata->data.stream_info));
+			break;
+		case FLAC__METADATA_TYPE_SEEKTABLE:
+			readSeekTable(fd, &(metadata->data.seek_table));
+			break;
+		case FLAC__METADATA_TYPE_VORBIS_COMMENT:
+			readVorbisComment(fd, &(metadata->data.vorbis_comment));
+			break;
+		default:
+			HIPXEL_LOG_ERROR("unexpected metadata, type: %d", (int) metadata->type);
+			break;
 	}
+}
 
-	if (fd->gotStreamInfo)
-		return;
+static float getReplayGain(hipxel_FlacDecoder *fd) {
+	bool album = fd->replayGain.mode == HIPXEL_REPLAYGAIN_ALBUM && fd->replayGain.hasAlbumGain;
+	bool track = fd->replayGain.mode != HIPXEL_REPLAYGAIN_OFF && fd->replayGain.hasTrackGain;
+	if (!album && !track)
+		return 1.0f;
 
-	FLAC__StreamMetadata_StreamInfo i = metadata->data.stream_info;
+	float db = album ? fd->replayGain.albumGainDb : fd->replayGain.trackGainDb;
+	float peak = album ? fd->replayGain.albumPeak : fd->replayGain.trackPeak;
 
-	fd->info.totalSamplesCount = i.total_samples;
-	fd->info.sampleRate = i.sample_rate;
-	fd->info.channelsCount = i.channels;
-	fd->info.bitsPerSample = i.bits_per_sample;
+	float gain = powf(10.0f, (db + fd->replayGain.preampDb) / 20.0f);
+	if (peak > 0.0f && gain * peak > 1.0f)
+		gain = 1.0f / peak;
+	return gain;
+}
 
-	fd->gotStreamInfo = true;
+static void setIdentityMatrix(hipxel_FlacDecoder *fd) {
+	uint32_t channelsCount = fd->info.channelsCount;
+
+	fd->output.channelsCount = channelsCount;
+	for (uint32_t o = 0; o < channelsCount; ++o) {
+		for (uint32_t c = 0; c < channelsCount; ++c)
+			fd->output.matrix[o * channelsCount + c] = o == c ? 1.0f : 0.0f;
+	}
+}
+
+static void updateOutput(hipxel_FlacDecoder *fd) {
+	uint32_t channelsCount = fd->info.channelsCount;
+	uint32_t outputChannelsCount = fd->output.channelsCount;
+
+	float gain = getReplayGain(fd);
+	float scale = gain * 65536.0f / (float) (1ull << fd->info.bitsPerSample);
+
+	// pure channel selection without gain can stay on integer shift path
+	bool selectionOnly = gain == 1.0f;
+	for (uint32_t o = 0; o < outputChannelsCount; ++o) {
+		const float *row = fd->output.matrix + o * channelsCount;
+		uint32_t nonZeroCount = 0;
+
+		for (uint32_t c = 0; c < channelsCount; ++c) {
+			fd->output.scaledMatrix[o * channelsCount + c] = row[c] * scale;
+
+			if (row[c] != 0.0f) {
+				++nonZeroCount;
+				fd->output.channelMap[o] = c;
+				if (row[c] != 1.0f)
+					selectionOnly = false;
+			}
+		}
+
+		if (nonZeroCount != 1)
+			selectionOnly = false;
+	}
+
+	fd->output.mixing = !selectionOnly;
 }
 
 static void errorCallback(
@@ -177,6 +563,62 @@ static void errorCallback(
 	// process_single will return false anyway if error was critical
 }
 
+static void publishStatus(hipxel_FlacDecoder *fd) {
+	hipxel_FlacDecoderStatus *s = &(fd->status);
+	uint32_t sequence = s->sequence + 1;
+
+	__atomic_store_n(&(s->sequence), sequence, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	s->flags = (fd->endOfFile ? HIPXEL_STATUS_END_OF_FILE : 0)
+			| (fd->finished ? HIPXEL_STATUS_FINISHED : 0);
+	s->pcmFramesPosition = hipxel_FlacDecoder_getPcmFramesPosition(fd);
+	s->bytesReadyCount = hipxel_FlacDecoder_getBytesReadyCount(fd);
+	s->totalSamplesCount = (int64_t) fd->info.totalSamplesCount;
+	s->sampleRate = fd->info.sampleRate;
+	s->channelsCount = fd->info.channelsCount;
+	s->bitsPerSample = fd->info.bitsPerSample;
+	s->outputChannelsCount = fd->output.channelsCount;
+	s->memoryFootprint = hipxel_FlacDecoder_getMemoryFootprint(fd);
+
+	__atomic_store_n(&(s->sequence), sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void fitBuffer(hipxel_FlacDecoder *fd) {
+	if (!fd->lowFootprint || fd->output.channelsCount == 0)
+		return;
+
+	uint32_t maxBlockSize = fd->info.maxBlockSize;
+	if (maxBlockSize == 0)
+		maxBlockSize = FLAC__MAX_BLOCK_SIZE;
+
+	// room for leftover block plus next one, so read and step cycles don't realloc,
+	// shrinking only once buffer grew well past that
+	int64_t capacity = 2 * (int64_t) maxBlockSize * outputFrameSize(fd);
+	int64_t current = hipxel_GrowingBuffer_getCapacity(fd->growingBuffer);
+	if (current < capacity || current > 2 * capacity)
+		hipxel_GrowingBuffer_fitCapacity(fd->growingBuffer, capacity);
+}
+
+static void setupScanner(hipxel_FlacDecoder *fd) {
+	FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder *) fd->internalDecoder;
+	hipxel_FrameScanner *fs = &(fd->scanner);
+
+	// decoder stopped right after metadata, so that's where frames begin
+	FLAC__uint64 position = 0;
+	if (FLAC__stream_decoder_get_decode_position(decoder, &position))
+		fs->firstFrameOffset = (int64_t) position;
+
+	fs->sourceLength = fd->sourceLength;
+	fs->info.totalSamplesCount = fd->info.totalSamplesCount;
+	fs->info.minBlockSize = fd->info.minBlockSize;
+	fs->info.maxBlockSize = fd->info.maxBlockSize;
+	fs->info.maxFrameSize = fd->info.maxFrameSize;
+	fs->info.sampleRate = fd->info.sampleRate;
+	fs->info.channelsCount = fd->info.channelsCount;
+	fs->info.bitsPerSample = fd->info.bitsPerSample;
+}
+
 static void reset(hipxel_FlacDecoder *fd, bool init) {
 	fd->finished = true;
 
@@ -218,6 +660,12 @@ static void reset(hipxel_FlacDecoder *fd, bool init) {
 		return;
 	}
 
+	if (!fd->output.customMatrix)
+		setIdentityMatrix(fd);
+	updateOutput(fd);
+	fitBuffer(fd);
+	setupScanner(fd);
+
 	fd->finished = false;
 }
 
@@ -234,6 +682,10 @@ static void init(hipxel_FlacDecoder *fd) {
 	FLAC__stream_decoder_set_metadata_ignore_all(decoder);
 	FLAC__stream_decoder_set_metadata_respond(
 			decoder, FLAC__METADATA_TYPE_STREAMINFO);
+	FLAC__stream_decoder_set_metadata_respond(
+			decoder, FLAC__METADATA_TYPE_SEEKTABLE);
+	FLAC__stream_decoder_set_metadata_respond(
+			decoder, FLAC__METADATA_TYPE_VORBIS_COMMENT);
 
 	FLAC__StreamDecoderInitStatus initStatus = FLAC__stream_decoder_init_stream(
 			decoder,
@@ -253,17 +705,288 @@ static void init(hipxel_FlacDecoder *fd) {
 		fd->initialized = true;
 }
 
-bool hipxel_FlacDecoder_step(hipxel_FlacDecoder *fd) {
+static void startReverse(hipxel_FlacDecoder *fd, int64_t position) {
+	hipxel_GrowingBuffer_clear(fd->growingBuffer);
+	fd->requestedSamplePosition = position;
+	fd->bytesWrittenSinceRequest = 0;
+
+	fd->reverse.endSample = position;
+	fd->reverse.hasFrame = position > 0
+			&& hipxel_FrameScanner_locate(&(fd->scanner), position - 1, &(fd->reverse.frame));
+	fd->finished = !fd->reverse.hasFrame;
+}
+
+static bool reverseStep(hipxel_FlacDecoder *fd) {
 	FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder *) fd->internalDecoder;
-	if (NULL == decoder)
+
+	if (!fd->reverse.hasFrame) {
+		fd->finished = true;
 		return false;
+	}
 
-	if (fd->endOfFile)
+	// drop whatever libFLAC buffered and let it sync exactly on located frame
+	if (!FLAC__stream_decoder_flush(decoder)) {
+		HIPXEL_LOG_ERROR("flush failed");
+		fd->finished = true;
+		return false;
+	}
+
+	fd->currentOffset = fd->reverse.frame.offset;
+	fd->endOfFile = false;
+
+	fd->calledWrite = false;
+	if (!FLAC__stream_decoder_process_single(decoder) || !fd->calledWrite) {
+		fd->finished = true;
+		return false;
+	}
+
+	fd->reverse.endSample = fd->reverse.frame.sampleNumber;
+
+	// find next earlier frame now, its bytes are most likely still in scanner's window
+	hipxel_FrameHeader previous;
+	fd->reverse.hasFrame = hipxel_FrameScanner_findPrevious(
+			&(fd->scanner), &(fd->reverse.frame), &previous);
+	if (fd->reverse.hasFrame)
+		fd->reverse.frame = previous;
+
+	return true;
+}
+
+#define SCRUB_GRAIN_MS 60
+#define SCRUB_FADE_MS 10
+
+static inline bool isScrubbing(hipxel_FlacDecoder *fd) {
+	return fd->scrub.speed != 0.0f;
+}
+
+static void startScrub(hipxel_FlacDecoder *fd, int64_t position) {
+	hipxel_GrowingBuffer_clear(fd->growingBuffer);
+	fd->requestedSamplePosition = position;
+	fd->bytesWrittenSinceRequest = 0;
+
+	fd->scrub.position = (double) position;
+	fd->scrub.tailLength = 0;
+}
+
+static void adaptGrain(hipxel_FlacDecoder *fd) {
+	uint32_t sampleRate = fd->info.sampleRate;
+	double seconds = (double) fd->scrub.framesOutput / sampleRate;
+	if (seconds <= 0.0)
+		return;
+
+	// fraction of budget used per second of output
+	double load = 0.0;
+	if (fd->scrub.maxFramesPerSecond > 0)
+		load = fd->scrub.framesDecoded / seconds / fd->scrub.maxFramesPerSecond;
+	if (fd->scrub.maxBytesPerSecond > 0) {
+		double bytesLoad = fd->scrub.bytesRead / seconds / fd->scrub.maxBytesPerSecond;
+		if (bytesLoad > load)
+			load = bytesLoad;
+	}
+
+	// longer grains mean fewer jumps, so fewer partially used frames and header scans
+	uint32_t minGrainLength = sampleRate * SCRUB_GRAIN_MS / 1000;
+	uint32_t grainLength = fd->scrub.grainLength;
+	if (load > 1.0)
+		grainLength += grainLength / 4;
+	else if (load < 0.5)
+		grainLength -= grainLength / 5;
+
+	if (grainLength < minGrainLength)
+		grainLength = minGrainLength;
+	if (grainLength > sampleRate)
+		grainLength = sampleRate;
+	fd->scrub.grainLength = grainLength;
+
+	// budget follows recent cost only
+	if (fd->scrub.framesOutput > 2 * (int64_t) sampleRate) {
+		fd->scrub.framesDecoded /= 2;
+		fd->scrub.bytesRead /= 2;
+		fd->scrub.framesOutput /= 2;
+	}
+}
+
+static bool scrubStep(hipxel_FlacDecoder *fd) {
+	FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder *) fd->internalDecoder;
+	uint32_t channelsCount = fd->output.channelsCount;
+	int64_t frameSize = outputFrameSize(fd);
+
+	int64_t start = (int64_t) fd->scrub.position;
+	int64_t bytesBefore = fd->bytesRead + fd->scanner.bytesRead;
+
+	hipxel_FrameHeader frame;
+	if (!hipxel_FrameScanner_locate(&(fd->scanner), start, &frame)) {
+		fd->finished = true;
+		return false;
+	}
+
+	if (!FLAC__stream_decoder_flush(decoder)) {
+		HIPXEL_LOG_ERROR("flush failed");
+		fd->finished = true;
+		return false;
+	}
+
+	fd->currentOffset = frame.offset;
+	fd->endOfFile = false;
+
+	// decode grain with room for crossfade into next one
+	hipxel_GrowingBuffer *grainBuffer = fd->scrub.grainBuffer;
+	hipxel_GrowingBuffer_clear(grainBuffer);
+	fd->writeBuffer = grainBuffer;
+
+	int64_t skip = start - frame.sampleNumber;
+	int64_t needed = (skip + fd->scrub.grainLength + fd->scrub.fadeLength) * frameSize;
+	int64_t framesDecoded = 0;
+	while (hipxel_GrowingBuffer_getLength(grainBuffer) < needed) {
+		fd->calledWrite = false;
+		if (!FLAC__stream_decoder_process_single(decoder) || !fd->calledWrite)
+			break;
+		++framesDecoded;
+	}
+
+	fd->writeBuffer = fd->growingBuffer;
+
+	int64_t grainFrames = hipxel_GrowingBuffer_getLength(grainBuffer) / frameSize - skip;
+	if (grainFrames <= 0) {
+		fd->finished = true;
+		return false;
+	}
+
+	const int16_t *grain = (const int16_t *) hipxel_GrowingBuffer_getData(grainBuffer)
+			+ skip * channelsCount;
+	int64_t emitFrames = grainFrames < fd->scrub.grainLength
+			? grainFrames : fd->scrub.grainLength;
+
+	int16_t *p = (int16_t *) hipxel_GrowingBuffer_claimForWrite(
+			fd->growingBuffer, emitFrames * frameSize);
+	if (NULL == p) {
+		fd->finished = true;
+		return false;
+	}
+
+	uint32_t fadeFrames = fd->scrub.tailLength < emitFrames
+			? fd->scrub.tailLength : (uint32_t) emitFrames;
+	crossFade(p, fd->scrub.tail, grain, fadeFrames, channelsCount);
+	memcpy(p + fadeFrames * channelsCount, grain + fadeFrames * channelsCount,
+			(size_t) ((emitFrames - fadeFrames) * frameSize));
+
+	int64_t tailFrames = grainFrames - emitFrames;
+	if (tailFrames > fd->scrub.fadeLength)
+		tailFrames = fd->scrub.fadeLength;
+	memcpy(fd->scrub.tail, grain + emitFrames * channelsCount, (size_t) (tailFrames * frameSize));
+	fd->scrub.tailLength = (uint32_t) tailFrames;
+
+	fd->scrub.position += emitFrames * (double) fd->scrub.speed;
+
+	fd->scrub.framesDecoded += framesDecoded;
+	fd->scrub.bytesRead += fd->bytesRead + fd->scanner.bytesRead - bytesBefore;
+	fd->scrub.framesOutput += emitFrames;
+	adaptGrain(fd);
+
+	return true;
+}
+
+// without frame, one containing position is located on first step
+static void startPipeline(hipxel_FlacDecoder *fd, int64_t position,
+                          const hipxel_FrameHeader *frame) {
+	hipxel_GrowingBuffer_clear(fd->growingBuffer);
+	fd->requestedSamplePosition = position;
+	fd->bytesWrittenSinceRequest = 0;
+
+	fd->endOfFile = false;
+	fd->pipeline.started = false;
+
+	if (NULL != frame) {
+		hipxel_FramePipeline_start(fd->pipeline.pipeline, frame);
+		fd->pipeline.started = true;
+	}
+}
+
+static void seekTo(hipxel_FlacDecoder *fd, int64_t position);
+
+static void releasePipeline(hipxel_FlacDecoder *fd) {
+	if (NULL == fd->pipeline.pipeline)
+		return;
+
+	hipxel_FramePipeline_delete(fd->pipeline.pipeline);
+	fd->pipeline.pipeline = NULL;
+	fd->pipeline.started = false;
+}
+
+static bool pipelineStep(hipxel_FlacDecoder *fd) {
+	hipxel_FramePipeline *fp = fd->pipeline.pipeline;
+
+	if (!fd->pipeline.started) {
+		hipxel_FrameHeader frame;
+		if (!hipxel_FrameScanner_locate(&(fd->scanner), fd->requestedSamplePosition, &frame)) {
+			fd->endOfFile = true;
+			fd->finished = true;
+			return false;
+		}
+
+		hipxel_FramePipeline_start(fp, &frame);
+		fd->pipeline.started = true;
+	}
+
+	const int32_t *const *samples = NULL;
+	uint32_t framesCount = 0;
+	int64_t sampleNumber = 0;
+	int result = hipxel_FramePipeline_next(fp, &samples, &framesCount, &sampleNumber);
+
+	if (result == HIPXEL_PIPELINE_END) {
+		fd->endOfFile = true;
+		fd->finished = true;
+		return false;
+	}
+
+	if (result == HIPXEL_PIPELINE_ERROR) {
+		// libFLAC on this thread takes over from position reached so far
+		HIPXEL_LOG_ERROR("pipeline failed, decoding on calling thread");
+		int64_t position = hipxel_FlacDecoder_getPcmFramesPosition(fd);
+		releasePipeline(fd);
+		seekTo(fd, position);
+		return !fd->finished;
+	}
+
+	// first frame after seek starts before requested position
+	uint32_t skip = 0;
+	if (sampleNumber < fd->requestedSamplePosition) {
+		int64_t before = fd->requestedSamplePosition - sampleNumber;
+		skip = before < framesCount ? (uint32_t) before : framesCount;
+	}
+
+	const FLAC__int32 *buffer[HIPXEL_FRAMEPIPELINE_MAX_CHANNELS];
+	for (uint32_t c = 0; c < fd->info.channelsCount; ++c)
+		buffer[c] = samples[c] + skip;
+
+	fd->calledWrite = true;
+	if (writeSamples(fd, buffer, framesCount - skip, false)
+			!= FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE)
+		fd->finished = true;
+
+	return !fd->finished;
+}
+
+static bool step(hipxel_FlacDecoder *fd) {
+	FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder *) fd->internalDecoder;
+	if (NULL == decoder)
 		return false;
 
 	if (fd->finished)
 		return false;
 
+	if (isScrubbing(fd))
+		return scrubStep(fd);
+
+	if (fd->reverse.enabled)
+		return reverseStep(fd);
+
+	if (NULL != fd->pipeline.pipeline)
+		return pipelineStep(fd);
+
+	if (fd->endOfFile)
+		return false;
+
 	fd->calledWrite = false;
 	fd->finished = !(FLAC__stream_decoder_process_single(decoder));
 
@@ -273,6 +996,15 @@ bool hipxel_FlacDecoder_step(hipxel_FlacDecoder *fd) {
 	return !fd->finished;
 }
 
+bool hipxel_FlacDecoder_step(hipxel_FlacDecoder *fd) {
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+	bool ret = step(fd);
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return ret;
+}
+
 jlong hipxel_FlacDecoder_readJni(hipxel_FlacDecoder *fd,
 		JNIEnv *env, jbyteArray buffer, jlong length) {
 	jlong red = hipxel_GrowingBuffer_consumeJni(fd->growingBuffer, env, buffer, length);
@@ -281,11 +1013,29 @@ jlong hipxel_FlacDecoder_readJni(hipxel_FlacDecoder *fd,
 		return red;
 
 	fd->bytesWrittenSinceRequest += red;
+	fitBuffer(fd);
+	publishStatus(fd);
 	return red;
 }
 
+const void *hipxel_FlacDecoder_peek(hipxel_FlacDecoder *fd, int64_t *outFramesCount) {
+	int64_t frameSize = outputFrameSize(fd);
+	*outFramesCount = frameSize > 0
+			? hipxel_GrowingBuffer_getLength(fd->growingBuffer) / frameSize : 0;
+	return hipxel_GrowingBuffer_getData(fd->growingBuffer);
+}
+
+void hipxel_FlacDecoder_consume(hipxel_FlacDecoder *fd, int64_t framesCount) {
+	int64_t discarded = hipxel_GrowingBuffer_discard(fd->growingBuffer,
+			framesCount * outputFrameSize(fd));
+
+	fd->bytesWrittenSinceRequest += discarded;
+	fitBuffer(fd);
+	publishStatus(fd);
+}
+
 static void slowSeekTo(hipxel_FlacDecoder *fd, int64_t position) {
-	int64_t reqByte = position * fd->info.channelsCount * sizeof(int16_t);
+	int64_t reqByte = position * outputFrameSize(fd);
 
 	if (fd->bytesWrittenSinceRequest > reqByte) {
 		reset(fd, false);
@@ -303,14 +1053,14 @@ static void slowSeekTo(hipxel_FlacDecoder *fd, int64_t position) {
 		fd->bytesWrittenSinceRequest += toTake;
 
 		if (hipxel_GrowingBuffer_getLength(fd->growingBuffer) <= 0) {
-			if (!hipxel_FlacDecoder_step(fd)) {
+			if (!step(fd)) {
 				return;
 			}
 		}
 	}
 }
 
-void hipxel_FlacDecoder_seekTo(hipxel_FlacDecoder *fd, int64_t position) {
+static void seekTo(hipxel_FlacDecoder *fd, int64_t position) {
 	FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder *) fd->internalDecoder;
 	if (NULL == decoder)
 		return;
@@ -329,6 +1079,25 @@ void hipxel_FlacDecoder_seekTo(hipxel_FlacDecoder *fd, int64_t position) {
 		return;
 	}
 
+	if (isScrubbing(fd)) {
+		startScrub(fd, position);
+		return;
+	}
+
+	if (fd->reverse.enabled) {
+		startReverse(fd, position);
+		return;
+	}
+
+	if (NULL != fd->pipeline.pipeline) {
+		startPipeline(fd, position, NULL);
+		return;
+	}
+
+	// aborted reverse decode leaves decoder in state where seek isn't accepted
+	if (FLAC__stream_decoder_get_state(decoder) > FLAC__STREAM_DECODER_END_OF_STREAM)
+		FLAC__stream_decoder_flush(decoder);
+
 	if (!FLAC__stream_decoder_seek_absolute(decoder, (uint64_t) position)) {
 		HIPXEL_LOG_ERROR("failed seek");
 	} else {
@@ -338,28 +1107,463 @@ void hipxel_FlacDecoder_seekTo(hipxel_FlacDecoder *fd, int64_t position) {
 	}
 }
 
+// seek point is used only if it really points at frame starting with its sample
+static bool findNearestSeekPoint(hipxel_FlacDecoder *fd, int64_t position,
+                                 hipxel_FrameHeader *out) {
+	hipxel_FrameScanner *fs = &(fd->scanner);
+	if (fs->seekPointsCount == 0)
+		return false;
+
+	// start of stream counts as seek point too
+	hipxel_SeekPoint nearest = {0, 0};
+	for (uint32_t i = 0; i < fs->seekPointsCount; ++i) {
+		const hipxel_SeekPoint *sp = &(fs->seekPoints[i]);
+		if (llabs(sp->sampleNumber - position) < llabs(nearest.sampleNumber - position))
+			nearest = *sp;
+	}
+
+	int64_t offset = fs->firstFrameOffset + nearest.offset;
+	return hipxel_FrameScanner_findNext(fs, offset, offset + 1, out)
+			&& out->sampleNumber == nearest.sampleNumber;
+}
+
+static bool findFrame(hipxel_FlacDecoder *fd, int64_t position, int mode,
+                      hipxel_FrameHeader *out) {
+	if (mode == HIPXEL_SEEK_NEAREST_SEEK_POINT && findNearestSeekPoint(fd, position, out))
+		return true;
+
+	if (!hipxel_FrameScanner_locate(&(fd->scanner), position, out))
+		return false;
+
+	if (mode == HIPXEL_SEEK_PREVIOUS_FRAME)
+		return true;
+
+	// next frame is nearer only if there is one, stream end isn't a place to land on
+	int64_t next = out->sampleNumber + out->blockSize;
+	hipxel_FrameHeader nextFrame;
+	if (next - position < position - out->sampleNumber
+			&& next < (int64_t) fd->info.totalSamplesCount
+			&& hipxel_FrameScanner_locate(&(fd->scanner), next, &nextFrame))
+		*out = nextFrame;
+
+	return true;
+}
+
+/**
+ * Lands on frame boundary instead of exact sample, so libFLAC or pipeline starts on
+ * located frame and nothing before it is decoded. Not used with unknown length nor
+ * in reverse and scrub modes, which already work with whole frames.
+ */
+static bool seekToFrame(hipxel_FlacDecoder *fd, int64_t position, int mode) {
+	FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder *) fd->internalDecoder;
+	if (NULL == decoder || fd->sourceLength < 0 || isScrubbing(fd) || fd->reverse.enabled)
+		return false;
+
+	if (position >= (int64_t) fd->info.totalSamplesCount)
+		return false;
+
+	if (position < 0)
+		position = 0;
+
+	hipxel_FrameHeader frame;
+	if (!findFrame(fd, position, mode, &frame))
+		return false;
+
+	if (NULL != fd->pipeline.pipeline) {
+		fd->finished = false;
+		startPipeline(fd, frame.sampleNumber, &frame);
+		return true;
+	}
+
+	if (!FLAC__stream_decoder_flush(decoder)) {
+		HIPXEL_LOG_ERROR("flush failed");
+		return false;
+	}
+
+	fd->finished = false;
+	fd->currentOffset = frame.offset;
+	fd->endOfFile = false;
+
+	hipxel_GrowingBuffer_clear(fd->growingBuffer);
+	fd->requestedSamplePosition = frame.sampleNumber;
+	fd->bytesWrittenSinceRequest = 0;
+	return true;
+}
+
+void hipxel_FlacDecoder_seekTo(hipxel_FlacDecoder *fd, int64_t position, int mode) {
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+	if (mode == HIPXEL_SEEK_EXACT || !seekToFrame(fd, position, mode))
+		seekTo(fd, position);
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+}
+
+static int64_t positionAfter(hipxel_FlacDecoder *fd, int64_t framesCount) {
+	if (isScrubbing(fd))
+		return fd->requestedSamplePosition + (int64_t) (framesCount * (double) fd->scrub.speed);
+	if (fd->reverse.enabled)
+		return fd->requestedSamplePosition - framesCount;
+	return fd->requestedSamplePosition + framesCount;
+}
+
 int64_t hipxel_FlacDecoder_getPcmFramesPosition(hipxel_FlacDecoder *fd) {
-	if (fd->info.channelsCount == 0)
+	if (fd->output.channelsCount == 0)
 		return 0;
 
-	int64_t offsetInPcmFrames =
-			fd->bytesWrittenSinceRequest / (fd->info.channelsCount * sizeof(int16_t));
-	return fd->requestedSamplePosition + offsetInPcmFrames;
+	return positionAfter(fd, fd->bytesWrittenSinceRequest / outputFrameSize(fd));
 }
 
 int64_t hipxel_FlacDecoder_getBytesReadyCount(hipxel_FlacDecoder *fd) {
 	return hipxel_GrowingBuffer_getLength(fd->growingBuffer);
 }
 
-hipxel_FlacDecoder *hipxel_FlacDecoder_new(hipxel_DataReader reader) {
-	hipxel_FlacDecoder *fd = malloc(sizeof(hipxel_FlacDecoder));
+static void rebaseOutput(hipxel_FlacDecoder *fd, int64_t oldFrameSize) {
+	if (oldFrameSize <= 0 || outputFrameSize(fd) == oldFrameSize)
+		return;
+
+	// already decoded bytes have old layout, drop them and decode again if needed
+	int64_t consumedFrames = fd->bytesWrittenSinceRequest / oldFrameSize;
+	int64_t bufferedFrames = hipxel_GrowingBuffer_getLength(fd->growingBuffer) / oldFrameSize;
+
+	hipxel_GrowingBuffer_clear(fd->growingBuffer);
+	fd->bytesWrittenSinceRequest = (consumedFrames + bufferedFrames) * outputFrameSize(fd);
+
+	fd->scrub.tailLength = 0;
+
+	if (bufferedFrames > 0)
+		seekTo(fd, positionAfter(fd, consumedFrames));
+}
+
+bool hipxel_FlacDecoder_setOutputMatrix(hipxel_FlacDecoder *fd,
+		uint32_t outputChannelsCount, const float *matrix) {
+	uint32_t channelsCount = fd->info.channelsCount;
+	if (channelsCount == 0)
+		return false;
+
+	if (NULL != matrix && (outputChannelsCount == 0 ||
+			outputChannelsCount > HIPXEL_FLACDECODER_MAX_CHANNELS)) {
+		HIPXEL_LOG_ERROR("invalid output channels count: %d", (int) outputChannelsCount);
+		return false;
+	}
+
+	int64_t oldFrameSize = outputFrameSize(fd);
+
+	if (NULL == matrix) {
+		fd->output.customMatrix = false;
+		setIdentityMatrix(fd);
+	} else {
+		fd->output.customMatrix = true;
+		fd->output.channelsCount = outputChannelsCount;
+		memcpy(fd->output.matrix, matrix,
+				outputChannelsCount * channelsCount * sizeof(float));
+	}
+
+	updateOutput(fd);
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+	rebaseOutput(fd, oldFrameSize);
+	fitBuffer(fd);
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return true;
+}
+
+bool hipxel_FlacDecoder_setOutputFormat(hipxel_FlacDecoder *fd, int format) {
+	if (format != HIPXEL_FORMAT_S16 && format != HIPXEL_FORMAT_S32
+			&& format != HIPXEL_FORMAT_FLOAT) {
+		HIPXEL_LOG_ERROR("invalid output format: %d", format);
+		return false;
+	}
+
+	if (format != HIPXEL_FORMAT_S16 && isScrubbing(fd)) {
+		HIPXEL_LOG_ERROR("scrub mode crossfades only 16-bit output");
+		return false;
+	}
+
+	int64_t oldFrameSize = outputFrameSize(fd);
+	fd->output.format = format;
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+	rebaseOutput(fd, oldFrameSize);
+	fitBuffer(fd);
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return true;
+}
+
+bool hipxel_FlacDecoder_setPipeline(hipxel_FlacDecoder *fd, uint32_t workersCount) {
+	bool enabled = workersCount > 0;
+
+	if (enabled && (fd->sourceLength < 0 || !fd->initialized)) {
+		HIPXEL_LOG_ERROR("pipeline needs source with known length");
+		return false;
+	}
+
+	if (enabled && (fd->reverse.enabled || isScrubbing(fd))) {
+		HIPXEL_LOG_ERROR("pipeline can't be used in reverse nor scrub mode");
+		return false;
+	}
+
+	int64_t position = hipxel_FlacDecoder_getPcmFramesPosition(fd);
+	bool ret = true;
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+
+	releasePipeline(fd);
+	if (enabled) {
+		fd->pipeline.pipeline = hipxel_FramePipeline_new(&(fd->scanner),
+				&(fd->memory), workersCount);
+		ret = NULL != fd->pipeline.pipeline;
+	}
+
+	// continue from same position on whichever path decodes now
+	seekTo(fd, position);
+
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return ret;
+}
+
+bool hipxel_FlacDecoder_setReverse(hipxel_FlacDecoder *fd, bool enabled) {
+	if (fd->reverse.enabled == enabled)
+		return true;
+
+	if (enabled && (fd->sourceLength < 0 || !fd->initialized)) {
+		HIPXEL_LOG_ERROR("reverse mode needs source with known length");
+		return false;
+	}
+
+	if (enabled && isScrubbing(fd)) {
+		HIPXEL_LOG_ERROR("reverse mode can't be used while scrubbing");
+		return false;
+	}
+
+	if (enabled && NULL != fd->pipeline.pipeline) {
+		HIPXEL_LOG_ERROR("reverse mode can't be used with pipeline");
+		return false;
+	}
+
+	if (enabled && fd->analysis.analyzeOnly) {
+		HIPXEL_LOG_ERROR("reverse mode can't be used in analyze only mode");
+		return false;
+	}
+
+	int64_t position = hipxel_FlacDecoder_getPcmFramesPosition(fd);
+	fd->reverse.enabled = enabled;
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+	seekTo(fd, position);
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return true;
+}
+
+static void releaseScrub(hipxel_FlacDecoder *fd) {
+	if (NULL != fd->scrub.grainBuffer)
+		hipxel_GrowingBuffer_delete(fd->scrub.grainBuffer);
+	hipxel_MemoryContext_deallocate(fd->scrub.tail);
+
+	fd->scrub.grainBuffer = NULL;
+	fd->scrub.tail = NULL;
+}
+
+static bool prepareScrub(hipxel_FlacDecoder *fd) {
+	if (NULL != fd->scrub.grainBuffer)
+		return true;
+
+	uint32_t sampleRate = fd->info.sampleRate;
+	fd->scrub.grainLength = sampleRate * SCRUB_GRAIN_MS / 1000;
+	fd->scrub.fadeLength = sampleRate * SCRUB_FADE_MS / 1000;
+	fd->scrub.tailLength = 0;
+	fd->scrub.framesDecoded = 0;
+	fd->scrub.bytesRead = 0;
+	fd->scrub.framesOutput = 0;
+
+	fd->scrub.grainBuffer = hipxel_GrowingBuffer_new(&(fd->memory));
+	fd->scrub.tail = hipxel_MemoryContext_allocate(&(fd->memory), fd->scrub.fadeLength
+			* HIPXEL_FLACDECODER_MAX_CHANNELS * sizeof(int16_t));
+
+	if (NULL == fd->scrub.grainBuffer || NULL == fd->scrub.tail) {
+		releaseScrub(fd);
+		return false;
+	}
+	return true;
+}
+
+bool hipxel_FlacDecoder_setScrub(hipxel_FlacDecoder *fd, float speed,
+		uint32_t maxFramesPerSecond, int64_t maxBytesPerSecond) {
+	bool enabled = speed != 0.0f;
+
+	if (enabled && (fd->sourceLength < 0 || !fd->initialized)) {
+		HIPXEL_LOG_ERROR("scrub mode needs source with known length");
+		return false;
+	}
+
+	if (enabled && fd->reverse.enabled) {
+		HIPXEL_LOG_ERROR("scrub mode can't be used in reverse mode");
+		return false;
+	}
+
+	if (enabled && fd->analysis.analyzeOnly) {
+		HIPXEL_LOG_ERROR("scrub mode can't be used in analyze only mode");
+		return false;
+	}
+
+	if (enabled && NULL != fd->pipeline.pipeline) {
+		HIPXEL_LOG_ERROR("scrub mode can't be used with pipeline");
+		return false;
+	}
+
+	if (enabled && fd->output.format != HIPXEL_FORMAT_S16) {
+		HIPXEL_LOG_ERROR("scrub mode crossfades only 16-bit output");
+		return false;
+	}
+
+	int64_t position = hipxel_FlacDecoder_getPcmFramesPosition(fd);
+	bool ret = true;
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+
+	if (enabled && !prepareScrub(fd)) {
+		HIPXEL_LOG_ERROR("couldn't allocate scrub buffers");
+		ret = false;
+	} else {
+		fd->scrub.speed = speed;
+		fd->scrub.maxFramesPerSecond = maxFramesPerSecond;
+		fd->scrub.maxBytesPerSecond = maxBytesPerSecond;
+
+		if (!enabled)
+			releaseScrub(fd);
+
+		// drop output produced with previous speed, so position stays consistent
+		seekTo(fd, position);
+	}
+
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return ret;
+}
+
+bool hipxel_FlacDecoder_setAnalysis(hipxel_FlacDecoder *fd, bool enabled, bool analyzeOnly) {
+	if (enabled && !fd->initialized)
+		return false;
+
+	if (enabled && analyzeOnly && (fd->reverse.enabled || isScrubbing(fd))) {
+		HIPXEL_LOG_ERROR("analyze only mode can't be used in reverse or scrub mode");
+		return false;
+	}
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+
+	if (!enabled && NULL != fd->analysis.analyzer) {
+		hipxel_LoudnessAnalyzer_delete(fd->analysis.analyzer);
+		fd->analysis.analyzer = NULL;
+	} else if (enabled && NULL == fd->analysis.analyzer) {
+		fd->analysis.analyzer = hipxel_LoudnessAnalyzer_new(&(fd->memory),
+				fd->info.sampleRate, fd->info.channelsCount, fd->info.bitsPerSample);
+	} else if (enabled) {
+		hipxel_LoudnessAnalyzer_reset(fd->analysis.analyzer);
+	}
+
+	bool ret = !enabled || NULL != fd->analysis.analyzer;
+	fd->analysis.analyzeOnly = ret && enabled && analyzeOnly;
+
+	// drop output decoded before switching mode
+	if (fd->analysis.analyzeOnly)
+		seekTo(fd, hipxel_FlacDecoder_getPcmFramesPosition(fd));
+
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return ret;
+}
+
+bool hipxel_FlacDecoder_getLoudness(hipxel_FlacDecoder *fd, hipxel_LoudnessResult *out) {
+	if (NULL == fd->analysis.analyzer)
+		return false;
+
+	hipxel_LoudnessAnalyzer_getResult(fd->analysis.analyzer, out);
+	return true;
+}
+
+bool hipxel_FlacDecoder_analyze(hipxel_FlacDecoder *fd, hipxel_LoudnessResult *out) {
+	if (!fd->initialized)
+		return false;
+
+	if (fd->reverse.enabled || isScrubbing(fd)) {
+		HIPXEL_LOG_ERROR("analyze only mode can't be used in reverse or scrub mode");
+		return false;
+	}
+
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+
+	// measures with its own analyzer, so one enabled by caller keeps what it accumulated
+	hipxel_LoudnessAnalyzer *analyzer = hipxel_LoudnessAnalyzer_new(&(fd->memory),
+			fd->info.sampleRate, fd->info.channelsCount, fd->info.bitsPerSample);
+	if (NULL == analyzer) {
+		hipxel_MemoryContext_bind(previous);
+		return false;
+	}
+
+	hipxel_LoudnessAnalyzer *callerAnalyzer = fd->analysis.analyzer;
+	bool callerAnalyzeOnly = fd->analysis.analyzeOnly;
+	fd->analysis.analyzer = analyzer;
+	fd->analysis.analyzeOnly = true;
+
+	seekTo(fd, 0);
+	while (step(fd)) {
+	}
+
+	hipxel_LoudnessAnalyzer_getResult(analyzer, out);
+	hipxel_LoudnessAnalyzer_delete(analyzer);
+
+	fd->analysis.analyzer = callerAnalyzer;
+	fd->analysis.analyzeOnly = callerAnalyzeOnly;
+
+	seekTo(fd, 0);
+
+	hipxel_MemoryContext_bind(previous);
+
+	publishStatus(fd);
+	return true;
+}
+
+void hipxel_FlacDecoder_setReplayGain(hipxel_FlacDecoder *fd, int mode, float preampDb) {
+	fd->replayGain.mode = mode;
+	fd->replayGain.preampDb = preampDb;
+
+	if (fd->output.channelsCount > 0)
+		updateOutput(fd);
+}
+
+hipxel_FlacDecoder *hipxel_FlacDecoder_new(hipxel_DataReader reader,
+		hipxel_Allocator allocator, bool lowFootprint) {
+	hipxel_FlacDecoder *fd = allocator.allocate(allocator.p, sizeof(hipxel_FlacDecoder));
+	if (NULL == fd) {
+		reader.release(reader.p);
+		return NULL;
+	}
+
+	hipxel_MemoryContext_init(&(fd->memory), allocator);
+	fd->memory.allocatedBytes = sizeof(hipxel_FlacDecoder);
+	fd->memory.peakBytes = sizeof(hipxel_FlacDecoder);
+	fd->lowFootprint = lowFootprint;
 
 	fd->reader = reader;
-	fd->growingBuffer = hipxel_GrowingBuffer_new();
+	fd->growingBuffer = hipxel_GrowingBuffer_new(&(fd->memory));
+	fd->writeBuffer = fd->growingBuffer;
 	fd->internalDecoder = NULL;
+	hipxel_FrameScanner_init(&(fd->scanner), &(fd->reader), &(fd->memory));
 
 	fd->sourceLength = -1;
 	fd->currentOffset = 0;
+	fd->bytesRead = 0;
 
 	fd->requestedSamplePosition = 0;
 	fd->bytesWrittenSinceRequest = 0;
@@ -371,25 +1575,82 @@ hipxel_FlacDecoder *hipxel_FlacDecoder_new(hipxel_DataReader reader) {
 	fd->gotStreamInfo = false;
 
 	fd->info.totalSamplesCount = 0;
+	fd->info.minBlockSize = 0;
+	fd->info.maxBlockSize = 0;
+	fd->info.maxFrameSize = 0;
 	fd->info.sampleRate = 0;
 	fd->info.channelsCount = 0;
 	fd->info.bitsPerSample = 0;
 
+	fd->output.channelsCount = 0;
+	fd->output.customMatrix = false;
+	fd->output.mixing = false;
+	fd->output.format = HIPXEL_FORMAT_S16;
+
+	fd->replayGain.mode = HIPXEL_REPLAYGAIN_OFF;
+	fd->replayGain.preampDb = 0.0f;
+	fd->replayGain.hasTrackGain = false;
+	fd->replayGain.hasAlbumGain = false;
+	fd->replayGain.trackGainDb = 0.0f;
+	fd->replayGain.albumGainDb = 0.0f;
+	fd->replayGain.trackPeak = 0.0f;
+	fd->replayGain.albumPeak = 0.0f;
+
+	fd->reverse.enabled = false;
+	fd->reverse.hasFrame = false;
+	fd->reverse.endSample = 0;
+
+	fd->scrub.speed = 0.0f;
+	fd->scrub.maxFramesPerSecond = 0;
+	fd->scrub.maxBytesPerSecond = 0;
+	fd->scrub.position = 0.0;
+	fd->scrub.grainLength = 0;
+	fd->scrub.fadeLength = 0;
+	fd->scrub.tailLength = 0;
+	fd->scrub.tail = NULL;
+	fd->scrub.grainBuffer = NULL;
+	fd->scrub.framesDecoded = 0;
+	fd->scrub.bytesRead = 0;
+	fd->scrub.framesOutput = 0;
+
+	fd->analysis.analyzer = NULL;
+	fd->analysis.analyzeOnly = false;
+
 	fd->sourceLength = reader.getSize(reader.p);
 
+	memset(&(fd->status), 0, sizeof(fd->status));
+
 	fd->initialized = false;
-	init(fd);
+	if (NULL != fd->growingBuffer) {
+		hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+		init(fd);
+		hipxel_MemoryContext_bind(previous);
+	}
+	publishStatus(fd);
 
 	return fd;
 }
 
 void hipxel_FlacDecoder_delete(hipxel_FlacDecoder *fd) {
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(fd->memory));
+
 	if (NULL != fd->internalDecoder)
 		FLAC__stream_decoder_delete((FLAC__StreamDecoder *) fd->internalDecoder);
 
-	hipxel_GrowingBuffer_delete(fd->growingBuffer);
+	if (NULL != fd->growingBuffer)
+		hipxel_GrowingBuffer_delete(fd->growingBuffer);
+
+	releaseScrub(fd);
+	releasePipeline(fd);
+	hipxel_FrameScanner_release(&(fd->scanner));
+
+	if (NULL != fd->analysis.analyzer)
+		hipxel_LoudnessAnalyzer_delete(fd->analysis.analyzer);
+
+	hipxel_MemoryContext_bind(previous);
 
 	fd->reader.release(fd->reader.p);
 
-	free(fd);
+	hipxel_Allocator allocator = fd->memory.allocator;
+	allocator.deallocate(allocator.p, fd);
 }
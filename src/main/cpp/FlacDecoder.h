@@ -17,21 +17,67 @@
 #ifndef HIPXEL_FLACDECODER
 #define HIPXEL_FLACDECODER
 
+#include "Allocator.h"
 #include "DataReader.h"
+#include "FrameScanner.h"
+#include "LoudnessAnalyzer.h"
 
 #include <stdbool.h>
 
 #include <jni.h>
 
+#define HIPXEL_FLACDECODER_MAX_CHANNELS 8
+
+#define HIPXEL_REPLAYGAIN_OFF 0
+#define HIPXEL_REPLAYGAIN_TRACK 1
+#define HIPXEL_REPLAYGAIN_ALBUM 2
+
+#define HIPXEL_FORMAT_S16 0
+#define HIPXEL_FORMAT_S32 1
+#define HIPXEL_FORMAT_FLOAT 2
+
+#define HIPXEL_SEEK_EXACT 0
+#define HIPXEL_SEEK_NEAREST_FRAME 1
+#define HIPXEL_SEEK_PREVIOUS_FRAME 2
+#define HIPXEL_SEEK_NEAREST_SEEK_POINT 3
+
+#define HIPXEL_STATUS_END_OF_FILE 1
+#define HIPXEL_STATUS_FINISHED 2
+
 struct hipxel_GrowingBuffer;
+struct hipxel_FramePipeline;
+
+/**
+ * Decoder state published for reading without JNI calls, layout is mirrored on java side.
+ * sequence is odd while update is in progress and is stored with release semantics
+ * once fields are consistent again.
+ */
+typedef struct hipxel_FlacDecoderStatus {
+	uint32_t sequence;
+	uint32_t flags;
+	int64_t pcmFramesPosition;
+	int64_t bytesReadyCount;
+	int64_t totalSamplesCount;
+	uint32_t sampleRate;
+	uint32_t channelsCount;
+	uint32_t bitsPerSample;
+	uint32_t outputChannelsCount;
+	int64_t memoryFootprint;
+} hipxel_FlacDecoderStatus;
 
 typedef struct hipxel_FlacDecoder {
+	hipxel_MemoryContext memory;
+	bool lowFootprint;
+
 	hipxel_DataReader reader;
 	struct hipxel_GrowingBuffer *growingBuffer;
+	struct hipxel_GrowingBuffer *writeBuffer;
 	void *internalDecoder;
+	hipxel_FrameScanner scanner;
 
 	int64_t sourceLength;
 	int64_t currentOffset;
+	int64_t bytesRead;
 
 	int64_t requestedSamplePosition;
 	int64_t bytesWrittenSinceRequest;
@@ -45,13 +91,77 @@ typedef struct hipxel_FlacDecoder {
 
 	struct {
 		uint64_t totalSamplesCount;
+		uint32_t minBlockSize;
+		uint32_t maxBlockSize;
+		uint32_t maxFrameSize;
 		uint32_t sampleRate;
 		uint32_t channelsCount;
 		uint32_t bitsPerSample;
 	} info;
+
+	struct {
+		uint32_t channelsCount;
+		int format;
+		bool customMatrix;
+		bool mixing;
+		uint32_t channelMap[HIPXEL_FLACDECODER_MAX_CHANNELS];
+		float matrix[HIPXEL_FLACDECODER_MAX_CHANNELS * HIPXEL_FLACDECODER_MAX_CHANNELS];
+		float scaledMatrix[HIPXEL_FLACDECODER_MAX_CHANNELS * HIPXEL_FLACDECODER_MAX_CHANNELS];
+	} output;
+
+	struct {
+		int mode;
+		float preampDb;
+		bool hasTrackGain;
+		bool hasAlbumGain;
+		float trackGainDb;
+		float albumGainDb;
+		float trackPeak;
+		float albumPeak;
+	} replayGain;
+
+	struct {
+		bool enabled;
+		bool hasFrame;
+		hipxel_FrameHeader frame;
+		int64_t endSample;
+	} reverse;
+
+	struct {
+		float speed;
+		uint32_t maxFramesPerSecond;
+		int64_t maxBytesPerSecond;
+		double position;
+		uint32_t grainLength;
+		uint32_t fadeLength;
+		uint32_t tailLength;
+		int16_t *tail;
+		struct hipxel_GrowingBuffer *grainBuffer;
+		int64_t framesDecoded;
+		int64_t bytesRead;
+		int64_t framesOutput;
+	} scrub;
+
+	struct {
+		hipxel_LoudnessAnalyzer *analyzer;
+		bool analyzeOnly;
+	} analysis;
+
+	struct {
+		struct hipxel_FramePipeline *pipeline;
+		bool started;
+	} pipeline;
+
+	hipxel_FlacDecoderStatus status;
 } hipxel_FlacDecoder;
 
-hipxel_FlacDecoder *hipxel_FlacDecoder_new(hipxel_DataReader reader);
+/**
+ * All allocations of decoder, its buffers and its libFLAC instance go through allocator.
+ * In low footprint mode output buffer is kept at two STREAMINFO's max blocks
+ * instead of staying as large as unread data once was.
+ */
+hipxel_FlacDecoder *hipxel_FlacDecoder_new(hipxel_DataReader reader,
+		hipxel_Allocator allocator, bool lowFootprint);
 
 void hipxel_FlacDecoder_delete(hipxel_FlacDecoder *fd);
 
@@ -60,12 +170,85 @@ bool hipxel_FlacDecoder_step(hipxel_FlacDecoder *fd);
 jlong hipxel_FlacDecoder_readJni(hipxel_FlacDecoder *fd,
 		JNIEnv *env, jbyteArray buffer, jlong length);
 
-void hipxel_FlacDecoder_seekTo(hipxel_FlacDecoder *fd, int64_t position);
+/**
+ * Native counterpart of read, decoded interleaved frames are looked at in place
+ * and then consumed, which advances position like reading them would.
+ */
+const void *hipxel_FlacDecoder_peek(hipxel_FlacDecoder *fd, int64_t *outFramesCount);
+
+void hipxel_FlacDecoder_consume(hipxel_FlacDecoder *fd, int64_t framesCount);
+
+/**
+ * Exact mode lands on given sample. Other modes land on start of nearest or previous
+ * frame, or on nearest SEEKTABLE point, so samples before it aren't decoded and thrown away.
+ * Position reached is reported by getPcmFramesPosition. Sources with unknown length,
+ * reverse and scrub modes always seek exactly.
+ */
+void hipxel_FlacDecoder_seekTo(hipxel_FlacDecoder *fd, int64_t position, int mode);
 
 int64_t hipxel_FlacDecoder_getPcmFramesPosition(hipxel_FlacDecoder *fd);
 
 int64_t hipxel_FlacDecoder_getBytesReadyCount(hipxel_FlacDecoder *fd);
 
+/**
+ * Sets row-major outputChannelsCount x channelsCount matrix applied while interleaving,
+ * so channel selection, downmix and per-channel gain are done in the same pass.
+ * NULL matrix restores plain interleaving of all source channels.
+ */
+bool hipxel_FlacDecoder_setOutputMatrix(hipxel_FlacDecoder *fd,
+		uint32_t outputChannelsCount, const float *matrix);
+
+/**
+ * Output is interleaved 16-bit, left aligned 32-bit or float in [-1, 1) samples,
+ * in native byte order. Scrub mode works only with 16-bit output.
+ */
+bool hipxel_FlacDecoder_setOutputFormat(hipxel_FlacDecoder *fd, int format);
+
+inline static int hipxel_FlacDecoder_getOutputFormat(hipxel_FlacDecoder *fd) {
+	return fd->output.format;
+}
+
+/**
+ * Applies gain from REPLAYGAIN_* tags on top of output matrix, limited by tagged peak.
+ */
+void hipxel_FlacDecoder_setReplayGain(hipxel_FlacDecoder *fd, int mode, float preampDb);
+
+/**
+ * In reverse mode each step decodes frame preceding previous one and writes it
+ * time-reversed, position then decreases while reading. Needs source with known length.
+ */
+bool hipxel_FlacDecoder_setReverse(hipxel_FlacDecoder *fd, bool enabled);
+
+/**
+ * With workersCount above 0 frames are decoded ahead on that many threads and handed back
+ * in order, conversion to output stays on calling thread. Meant for high resolution
+ * multichannel streams one core can't keep up with. Needs source with known length.
+ */
+bool hipxel_FlacDecoder_setPipeline(hipxel_FlacDecoder *fd, uint32_t workersCount);
+
+/**
+ * Scrub mode outputs short grains taken every speed * grain length samples and
+ * crossfaded together, decoding only frames grains fall into. Grains get longer while
+ * more than maxFramesPerSecond FLAC frames are decoded or more than maxBytesPerSecond
+ * are read per second of output, 0 means no limit. Zero speed turns scrub mode off.
+ */
+bool hipxel_FlacDecoder_setScrub(hipxel_FlacDecoder *fd, float speed,
+		uint32_t maxFramesPerSecond, int64_t maxBytesPerSecond);
+
+/**
+ * Attaches loudness analyzer fed with every frame decoded in normal forward mode.
+ * In analyze only mode frames aren't converted nor buffered, position still advances.
+ */
+bool hipxel_FlacDecoder_setAnalysis(hipxel_FlacDecoder *fd, bool enabled, bool analyzeOnly);
+
+bool hipxel_FlacDecoder_getLoudness(hipxel_FlacDecoder *fd, hipxel_LoudnessResult *out);
+
+/**
+ * Analyzes whole stream in analyze only mode and rewinds to start afterwards.
+ * Uses its own analyzer, one attached by setAnalysis keeps its result and mode.
+ */
+bool hipxel_FlacDecoder_analyze(hipxel_FlacDecoder *fd, hipxel_LoudnessResult *out);
+
 inline static uint32_t hipxel_FlacDecoder_getSampleRate(hipxel_FlacDecoder *fd) {
 	return fd->info.sampleRate;
 }
@@ -78,8 +261,20 @@ inline static uint32_t hipxel_FlacDecoder_getBitsPerSample(hipxel_FlacDecoder *f
 	return fd->info.bitsPerSample;
 }
 
+inline static bool hipxel_FlacDecoder_isFinished(hipxel_FlacDecoder *fd) {
+	return fd->finished;
+}
+
+inline static uint32_t hipxel_FlacDecoder_getOutputChannelsCount(hipxel_FlacDecoder *fd) {
+	return fd->output.channelsCount;
+}
+
 inline static uint64_t hipxel_FlacDecoder_getTotalSamplesCount(hipxel_FlacDecoder *fd) {
 	return fd->info.totalSamplesCount;
 }
 
+inline static int64_t hipxel_FlacDecoder_getMemoryFootprint(hipxel_FlacDecoder *fd) {
+	return fd->memory.allocatedBytes;
+}
+
 #endif // HIPXEL_FLACDECODER
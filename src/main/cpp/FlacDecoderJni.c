@@ -14,8 +14,13 @@
  * limitations under the License.
  */
 
+#include "CachingDataReader.h"
 #include "FlacDecoder.h"
+#include "FlacMixer.h"
+#include "FlacStream.h"
+#include "FlacTrimmer.h"
 #include "JavaDataReader.h"
+#include "PoolAllocator.h"
 
 #include <jni.h>
 #include <stdlib.h>
@@ -24,10 +29,31 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved) {
 	return JNI_VERSION_1_6;
 }
 
-JNIEXPORT jobject JNICALL
-Java_com_hipxel_flac_FlacDecoder_create(JNIEnv *env, jobject thiz, jobject dataReader) {
+static hipxel_DataReader createReader(JNIEnv *env, jobject dataReader,
+                                      jstring cacheDirectory, jstring cacheKey,
+                                      jlong cacheBudgetBytes) {
 	hipxel_DataReader jdr = hipxel_JavaDataReader_create(env, dataReader);
-	hipxel_FlacDecoder *ptr = hipxel_FlacDecoder_new(jdr);
+
+	if (NULL != cacheDirectory && NULL != cacheKey) {
+		const char *directory = (*env)->GetStringUTFChars(env, cacheDirectory, NULL);
+		const char *key = (*env)->GetStringUTFChars(env, cacheKey, NULL);
+
+		jdr = hipxel_CachingDataReader_create(jdr, directory, key, cacheBudgetBytes);
+
+		(*env)->ReleaseStringUTFChars(env, cacheKey, key);
+		(*env)->ReleaseStringUTFChars(env, cacheDirectory, directory);
+	}
+
+	return jdr;
+}
+
+static jobject createDecoder(JNIEnv *env, hipxel_DataReader reader,
+                             jboolean lowFootprint, jboolean pooledMemory) {
+	hipxel_Allocator allocator = pooledMemory
+			? hipxel_PoolAllocator_shared() : hipxel_Allocator_system();
+	hipxel_FlacDecoder *ptr = hipxel_FlacDecoder_new(reader, allocator, lowFootprint);
+	if (NULL == ptr)
+		return NULL;
 
 	if (!ptr->initialized) {
 		hipxel_FlacDecoder_delete(ptr);
@@ -37,12 +63,35 @@ Java_com_hipxel_flac_FlacDecoder_create(JNIEnv *env, jobject thiz, jobject dataR
 	return (*env)->NewDirectByteBuffer(env, ptr, sizeof(ptr));
 }
 
+JNIEXPORT jobject JNICALL
+Java_com_hipxel_flac_FlacDecoder_create(JNIEnv *env, jobject thiz, jobject dataReader,
+                                        jstring cacheDirectory, jstring cacheKey,
+                                        jlong cacheBudgetBytes, jboolean lowFootprint,
+                                        jboolean pooledMemory) {
+	hipxel_DataReader jdr = createReader(env, dataReader,
+			cacheDirectory, cacheKey, cacheBudgetBytes);
+	return createDecoder(env, jdr, lowFootprint, pooledMemory);
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_hipxel_flac_FlacDecoder_createCursor(JNIEnv *env, jobject thiz, jobject streamPointer,
+                                              jboolean lowFootprint, jboolean pooledMemory) {
+	hipxel_FlacStream *stream = (*env)->GetDirectBufferAddress(env, streamPointer);
+	return createDecoder(env, hipxel_FlacStream_openCursor(stream), lowFootprint, pooledMemory);
+}
+
 JNIEXPORT void JNICALL
 Java_com_hipxel_flac_FlacDecoder_release(JNIEnv *env, jobject thiz, jobject pointer) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
 	hipxel_FlacDecoder_delete(ptr);
 }
 
+JNIEXPORT jobject JNICALL
+Java_com_hipxel_flac_FlacDecoder_getStatusBuffer(JNIEnv *env, jobject thiz, jobject pointer) {
+	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return (*env)->NewDirectByteBuffer(env, &(ptr->status), sizeof(ptr->status));
+}
+
 JNIEXPORT jboolean JNICALL
 Java_com_hipxel_flac_FlacDecoder_step(JNIEnv *env, jobject thiz, jobject pointer) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
@@ -58,43 +107,221 @@ Java_com_hipxel_flac_FlacDecoder_read(JNIEnv *env, jobject thiz,
 
 JNIEXPORT void JNICALL
 Java_com_hipxel_flac_FlacDecoder_seekTo(JNIEnv *env, jobject thiz,
-                                        jobject pointer, jlong position) {
+                                        jobject pointer, jlong position, jint mode) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	hipxel_FlacDecoder_seekTo(ptr, position);
+	hipxel_FlacDecoder_seekTo(ptr, position, mode);
 }
 
-JNIEXPORT jint JNICALL
-Java_com_hipxel_flac_FlacDecoder_getSampleRate(JNIEnv *env, jobject thiz, jobject pointer) {
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacDecoder_setOutputMatrix(JNIEnv *env, jobject thiz, jobject pointer,
+                                                 jint outputChannelsCount, jfloatArray matrix) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	return hipxel_FlacDecoder_getSampleRate(ptr);
+	if (NULL == matrix)
+		return (jboolean) hipxel_FlacDecoder_setOutputMatrix(ptr, 0, NULL);
+
+	jsize expected = outputChannelsCount * (jsize) hipxel_FlacDecoder_getChannelsCount(ptr);
+	if (outputChannelsCount <= 0 || outputChannelsCount > HIPXEL_FLACDECODER_MAX_CHANNELS
+			|| (*env)->GetArrayLength(env, matrix) != expected)
+		return JNI_FALSE;
+
+	float m[HIPXEL_FLACDECODER_MAX_CHANNELS * HIPXEL_FLACDECODER_MAX_CHANNELS];
+	(*env)->GetFloatArrayRegion(env, matrix, 0, expected, m);
+	return (jboolean) hipxel_FlacDecoder_setOutputMatrix(ptr, (uint32_t) outputChannelsCount, m);
 }
 
-JNIEXPORT jint JNICALL
-Java_com_hipxel_flac_FlacDecoder_getChannelsCount(JNIEnv *env, jobject thiz, jobject pointer) {
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacDecoder_setOutputFormat(JNIEnv *env, jobject thiz, jobject pointer,
+                                                 jint format) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	return hipxel_FlacDecoder_getChannelsCount(ptr);
+	return (jboolean) hipxel_FlacDecoder_setOutputFormat(ptr, format);
 }
 
-JNIEXPORT jint JNICALL
-Java_com_hipxel_flac_FlacDecoder_getBitsPerSample(JNIEnv *env, jobject thiz, jobject pointer) {
+JNIEXPORT void JNICALL
+Java_com_hipxel_flac_FlacDecoder_setReplayGain(JNIEnv *env, jobject thiz, jobject pointer,
+                                               jint mode, jfloat preampDb) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	return hipxel_FlacDecoder_getBitsPerSample(ptr);
+	hipxel_FlacDecoder_setReplayGain(ptr, mode, preampDb);
 }
 
-JNIEXPORT jlong JNICALL
-Java_com_hipxel_flac_FlacDecoder_getTotalSamplesCount(JNIEnv *env, jobject thiz, jobject pointer) {
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacDecoder_setReverse(JNIEnv *env, jobject thiz, jobject pointer,
+                                            jboolean enabled) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	return hipxel_FlacDecoder_getTotalSamplesCount(ptr);
+	return (jboolean) hipxel_FlacDecoder_setReverse(ptr, enabled == JNI_TRUE);
 }
 
-JNIEXPORT jlong JNICALL
-Java_com_hipxel_flac_FlacDecoder_getPcmFramesPosition(JNIEnv *env, jobject thiz, jobject pointer) {
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacDecoder_setPipeline(JNIEnv *env, jobject thiz, jobject pointer,
+                                             jint workersCount) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	return hipxel_FlacDecoder_getPcmFramesPosition(ptr);
+	if (workersCount < 0)
+		return JNI_FALSE;
+
+	return (jboolean) hipxel_FlacDecoder_setPipeline(ptr, (uint32_t) workersCount);
 }
 
-JNIEXPORT jlong JNICALL
-Java_com_hipxel_flac_FlacDecoder_getBytesReadyCount(JNIEnv *env, jobject thiz, jobject pointer) {
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacDecoder_setScrub(JNIEnv *env, jobject thiz, jobject pointer,
+                                          jfloat speed, jint maxFramesPerSecond,
+                                          jlong maxBytesPerSecond) {
 	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
-	return hipxel_FlacDecoder_getBytesReadyCount(ptr);
+	if (maxFramesPerSecond < 0 || maxBytesPerSecond < 0)
+		return JNI_FALSE;
+
+	return (jboolean) hipxel_FlacDecoder_setScrub(ptr, speed,
+			(uint32_t) maxFramesPerSecond, maxBytesPerSecond);
+}
+
+static jdoubleArray newLoudnessArray(JNIEnv *env, const hipxel_LoudnessResult *result) {
+	jdouble values[5] = {
+			result->integratedLufs,
+			result->loudnessRangeLu,
+			result->samplePeak,
+			result->truePeak,
+			result->replayGainDb
+	};
+
+	jdoubleArray array = (*env)->NewDoubleArray(env, 5);
+	if (NULL != array)
+		(*env)->SetDoubleArrayRegion(env, array, 0, 5, values);
+	return array;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacDecoder_setAnalysis(JNIEnv *env, jobject thiz, jobject pointer,
+                                             jboolean enabled, jboolean analyzeOnly) {
+	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return (jboolean) hipxel_FlacDecoder_setAnalysis(ptr, enabled == JNI_TRUE,
+			analyzeOnly == JNI_TRUE);
+}
+
+JNIEXPORT jdoubleArray JNICALL
+Java_com_hipxel_flac_FlacDecoder_getLoudness(JNIEnv *env, jobject thiz, jobject pointer) {
+	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+
+	hipxel_LoudnessResult result;
+	if (!hipxel_FlacDecoder_getLoudness(ptr, &result))
+		return NULL;
+	return newLoudnessArray(env, &result);
+}
+
+JNIEXPORT jdoubleArray JNICALL
+Java_com_hipxel_flac_FlacDecoder_analyze(JNIEnv *env, jobject thiz, jobject pointer) {
+	hipxel_FlacDecoder *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+
+	hipxel_LoudnessResult result;
+	if (!hipxel_FlacDecoder_analyze(ptr, &result))
+		return NULL;
+	return newLoudnessArray(env, &result);
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_hipxel_flac_FlacStream_create(JNIEnv *env, jobject thiz, jobject dataReader,
+                                       jstring cacheDirectory, jstring cacheKey,
+                                       jlong cacheBudgetBytes, jlong blockCacheBytes) {
+	hipxel_DataReader jdr = createReader(env, dataReader,
+			cacheDirectory, cacheKey, cacheBudgetBytes);
+
+	hipxel_FlacStream *ptr = hipxel_FlacStream_new(jdr, blockCacheBytes);
+	if (NULL == ptr)
+		return NULL;
+
+	return (*env)->NewDirectByteBuffer(env, ptr, sizeof(ptr));
+}
+
+JNIEXPORT void JNICALL
+Java_com_hipxel_flac_FlacStream_release(JNIEnv *env, jobject thiz, jobject pointer) {
+	hipxel_FlacStream *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	hipxel_FlacStream_release(ptr);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacStream_trim(JNIEnv *env, jobject thiz, jobject pointer,
+                                     jstring outputPath, jlong startSample, jlong endSample) {
+	hipxel_FlacStream *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+
+	const char *path = (*env)->GetStringUTFChars(env, outputPath, NULL);
+	bool result = hipxel_FlacTrimmer_trim(ptr, path, startSample, endSample);
+	(*env)->ReleaseStringUTFChars(env, outputPath, path);
+
+	return (jboolean) result;
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_hipxel_flac_FlacMixer_create(JNIEnv *env, jobject thiz, jint sampleRate,
+                                      jint channelsCount, jboolean pooledMemory) {
+	if (sampleRate <= 0 || channelsCount <= 0)
+		return NULL;
+
+	hipxel_Allocator allocator = pooledMemory
+			? hipxel_PoolAllocator_shared() : hipxel_Allocator_system();
+	hipxel_FlacMixer *ptr = hipxel_FlacMixer_new(allocator,
+			(uint32_t) sampleRate, (uint32_t) channelsCount);
+	if (NULL == ptr)
+		return NULL;
+
+	return (*env)->NewDirectByteBuffer(env, ptr, sizeof(ptr));
+}
+
+JNIEXPORT void JNICALL
+Java_com_hipxel_flac_FlacMixer_release(JNIEnv *env, jobject thiz, jobject pointer) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	hipxel_FlacMixer_delete(ptr);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_hipxel_flac_FlacMixer_addSource(JNIEnv *env, jobject thiz, jobject pointer,
+                                         jobject decoderPointer, jfloat gain) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	hipxel_FlacDecoder *decoder = (*env)->GetDirectBufferAddress(env, decoderPointer);
+	return hipxel_FlacMixer_addSource(ptr, decoder, gain);
+}
+
+JNIEXPORT void JNICALL
+Java_com_hipxel_flac_FlacMixer_removeSource(JNIEnv *env, jobject thiz, jobject pointer,
+                                            jint index) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	hipxel_FlacMixer_removeSource(ptr, index);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacMixer_setGain(JNIEnv *env, jobject thiz, jobject pointer,
+                                       jint index, jfloat gain, jlong rampFrames) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return (jboolean) hipxel_FlacMixer_setGain(ptr, index, gain, rampFrames);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacMixer_setPaused(JNIEnv *env, jobject thiz, jobject pointer,
+                                         jint index, jboolean paused) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return (jboolean) hipxel_FlacMixer_setPaused(ptr, index, paused == JNI_TRUE);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacMixer_seekSource(JNIEnv *env, jobject thiz, jobject pointer,
+                                          jint index, jlong position, jint mode) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return (jboolean) hipxel_FlacMixer_seekSource(ptr, index, position, mode);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_hipxel_flac_FlacMixer_getSourcePosition(JNIEnv *env, jobject thiz, jobject pointer,
+                                                 jint index) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return hipxel_FlacMixer_getSourcePosition(ptr, index);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_hipxel_flac_FlacMixer_step(JNIEnv *env, jobject thiz, jobject pointer,
+                                    jlong framesAhead) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return (jboolean) hipxel_FlacMixer_step(ptr, framesAhead);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_hipxel_flac_FlacMixer_read(JNIEnv *env, jobject thiz,
+                                    jobject pointer, jbyteArray buffer, jlong length) {
+	hipxel_FlacMixer *ptr = (*env)->GetDirectBufferAddress(env, pointer);
+	return hipxel_FlacMixer_readJni(ptr, env, buffer, length);
 }
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FlacMixer.h"
+
+#include <string.h>
+
+typedef float hipxel_v4f __attribute__((vector_size(16)));
+typedef int32_t hipxel_v4i __attribute__((vector_size(16)));
+typedef int16_t hipxel_v4s __attribute__((vector_size(8)));
+
+static inline hipxel_v4f splat(float v) {
+	hipxel_v4f r = {v, v, v, v};
+	return r;
+}
+
+static inline hipxel_v4f blend(hipxel_v4i mask, hipxel_v4f a, hipxel_v4f b) {
+	return (hipxel_v4f) (((hipxel_v4i) a & mask) | ((hipxel_v4i) b & ~mask));
+}
+
+static inline hipxel_v4f load(const float *src) {
+	hipxel_v4f v;
+	memcpy(&v, src, sizeof(v));
+	return v;
+}
+
+static inline void store(float *dst, hipxel_v4f v) {
+	memcpy(dst, &v, sizeof(v));
+}
+
+static inline hipxel_v4f loadSamples(const int16_t *src) {
+	hipxel_v4s v;
+	memcpy(&v, src, sizeof(v));
+	return __builtin_convertvector(v, hipxel_v4f);
+}
+
+static inline int16_t clampToInt16(float v) {
+	if (v >= 32767.0f)
+		return 32767;
+	if (v <= -32768.0f)
+		return -32768;
+	return (int16_t) (v < 0.0f ? v - 0.5f : v + 0.5f);
+}
+
+static inline void accumulate(float *acc, const int16_t *src,
+                              uint32_t samplesCount, float gain) {
+	hipxel_v4f g = splat(gain);
+	uint32_t i = 0;
+	for (; i + 4 <= samplesCount; i += 4)
+		store(acc + i, load(acc + i) + loadSamples(src + i) * g);
+
+	for (; i < samplesCount; ++i)
+		acc[i] += gain * (float) src[i];
+}
+
+// gain changes every frame, samples of one frame share it
+static inline void accumulateRamp(float *acc, const int16_t *src,
+                                  uint32_t framesCount, uint32_t channelsCount,
+                                  float gain, float gainStep) {
+	uint32_t samplesCount = framesCount * channelsCount;
+	uint32_t i = 0;
+
+	// vector holds whole frames only for 1, 2 and 4 channels
+	if (4 % channelsCount == 0) {
+		hipxel_v4f laneFrames = {
+				(float) (0 / channelsCount), (float) (1 / channelsCount),
+				(float) (2 / channelsCount), (float) (3 / channelsCount)
+		};
+		hipxel_v4f laneSteps = laneFrames * splat(gainStep);
+
+		for (; i + 4 <= samplesCount; i += 4) {
+			hipxel_v4f g = splat(gain + gainStep * (float) (i / channelsCount)) + laneSteps;
+			store(acc + i, load(acc + i) + loadSamples(src + i) * g);
+		}
+	}
+
+	for (; i < samplesCount; ++i)
+		acc[i] += (gain + gainStep * (float) (i / channelsCount)) * (float) src[i];
+}
+
+static inline void convertToInt16(int16_t *dst, const float *src, uint32_t samplesCount) {
+	hipxel_v4f hi = splat(32767.0f);
+	hipxel_v4f lo = splat(-32768.0f);
+	hipxel_v4f half = splat(0.5f);
+
+	uint32_t i = 0;
+	for (; i + 4 <= samplesCount; i += 4) {
+		hipxel_v4f v = load(src + i);
+		v = blend(v > hi, hi, v);
+		v = blend(v < lo, lo, v);
+		v += blend(v < splat(0.0f), -half, half);
+
+		hipxel_v4s s = __builtin_convertvector(__builtin_convertvector(v, hipxel_v4i), hipxel_v4s);
+		memcpy(dst + i, &s, sizeof(s));
+	}
+
+	for (; i < samplesCount; ++i)
+		dst[i] = clampToInt16(src[i]);
+}
+
+static hipxel_MixerSource *getSource(hipxel_FlacMixer *fm, int index) {
+	if (index < 0 || index >= HIPXEL_FLACMIXER_MAX_SOURCES)
+		return NULL;
+
+	hipxel_MixerSource *s = &(fm->sources[index]);
+	return NULL != s->decoder ? s : NULL;
+}
+
+static hipxel_MixerSource *findNeediest(hipxel_FlacMixer *fm, int64_t framesAhead) {
+	hipxel_MixerSource *neediest = NULL;
+	int64_t least = framesAhead;
+
+	for (int i = 0; i < HIPXEL_FLACMIXER_MAX_SOURCES; ++i) {
+		hipxel_MixerSource *s = &(fm->sources[i]);
+		if (NULL == s->decoder || s->paused || s->exhausted)
+			continue;
+
+		int64_t available = 0;
+		hipxel_FlacDecoder_peek(s->decoder, &available);
+		if (available < least) {
+			least = available;
+			neediest = s;
+		}
+	}
+
+	return neediest;
+}
+
+static void stepSource(hipxel_MixerSource *s) {
+	if (!hipxel_FlacDecoder_step(s->decoder))
+		s->exhausted = true;
+}
+
+static void fill(hipxel_FlacMixer *fm, int64_t framesCount) {
+	hipxel_MixerSource *s;
+	while (NULL != (s = findNeediest(fm, framesCount)))
+		stepSource(s);
+}
+
+static void mixSource(hipxel_FlacMixer *fm, hipxel_MixerSource *s, const int16_t *data,
+                      uint32_t framesCount, uint32_t chunkFrames) {
+	uint32_t channelsCount = fm->channelsCount;
+	float *acc = fm->mixBuffer;
+
+	// ramp follows output frames, so it keeps going over missing data
+	uint32_t rampFrames = s->rampFramesLeft < chunkFrames ? (uint32_t) s->rampFramesLeft : chunkFrames;
+	uint32_t rampDataFrames = rampFrames < framesCount ? rampFrames : framesCount;
+
+	if (rampDataFrames > 0)
+		accumulateRamp(acc, data, rampDataFrames, channelsCount, s->gain, s->gainStep);
+
+	if (rampFrames > 0) {
+		s->rampFramesLeft -= rampFrames;
+		s->gain = s->rampFramesLeft > 0 ? s->gain + s->gainStep * (float) rampFrames : s->targetGain;
+	}
+
+	if (framesCount > rampDataFrames && s->gain != 0.0f) {
+		uint32_t offset = rampDataFrames * channelsCount;
+		accumulate(acc + offset, data + offset,
+				(framesCount - rampDataFrames) * channelsCount, s->gain);
+	}
+}
+
+static bool mixChunk(hipxel_FlacMixer *fm, int16_t *dst, uint32_t chunkFrames) {
+	fill(fm, chunkFrames);
+
+	uint32_t samplesCount = chunkFrames * fm->channelsCount;
+	memset(fm->mixBuffer, 0, samplesCount * sizeof(float));
+
+	bool live = false;
+	for (int i = 0; i < HIPXEL_FLACMIXER_MAX_SOURCES; ++i) {
+		hipxel_MixerSource *s = &(fm->sources[i]);
+		if (NULL == s->decoder)
+			continue;
+
+		if (s->paused) {
+			live = true;
+			continue;
+		}
+
+		int64_t available = 0;
+		const int16_t *data = (const int16_t *) hipxel_FlacDecoder_peek(s->decoder, &available);
+		if (available > chunkFrames)
+			available = chunkFrames;
+		if (available > 0 || !s->exhausted)
+			live = true;
+
+		mixSource(fm, s, data, (uint32_t) available, chunkFrames);
+		if (available > 0)
+			hipxel_FlacDecoder_consume(s->decoder, available);
+	}
+
+	if (!live)
+		return false;
+
+	convertToInt16(dst, fm->mixBuffer, samplesCount);
+	return true;
+}
+
+int64_t hipxel_FlacMixer_mix(hipxel_FlacMixer *fm, int16_t *dst, int64_t framesCount) {
+	int64_t done = 0;
+
+	while (done < framesCount) {
+		int64_t left = framesCount - done;
+		uint32_t chunkFrames = left < HIPXEL_FLACMIXER_CHUNK_FRAMES
+				? (uint32_t) left : HIPXEL_FLACMIXER_CHUNK_FRAMES;
+
+		if (!mixChunk(fm, dst + done * fm->channelsCount, chunkFrames))
+			break;
+		done += chunkFrames;
+	}
+
+	return done;
+}
+
+jlong hipxel_FlacMixer_readJni(hipxel_FlacMixer *fm,
+		JNIEnv *env, jbyteArray buffer, jlong length) {
+	int64_t frameSize = fm->channelsCount * sizeof(int16_t);
+	int64_t framesCount = length / frameSize;
+	int64_t done = 0;
+
+	while (done < framesCount) {
+		int64_t left = framesCount - done;
+		int64_t chunkFrames = left < HIPXEL_FLACMIXER_CHUNK_FRAMES
+				? left : HIPXEL_FLACMIXER_CHUNK_FRAMES;
+
+		int64_t mixed = hipxel_FlacMixer_mix(fm, fm->outputBuffer, chunkFrames);
+		if (mixed <= 0)
+			break;
+
+		(*env)->SetByteArrayRegion(env, buffer, (jsize) (done * frameSize),
+				(jsize) (mixed * frameSize), (jbyte *) fm->outputBuffer);
+		done += mixed;
+	}
+
+	return done * frameSize;
+}
+
+bool hipxel_FlacMixer_step(hipxel_FlacMixer *fm, int64_t framesAhead) {
+	hipxel_MixerSource *s = findNeediest(fm, framesAhead);
+	if (NULL == s)
+		return false;
+
+	stepSource(s);
+	return true;
+}
+
+int hipxel_FlacMixer_addSource(hipxel_FlacMixer *fm, hipxel_FlacDecoder *decoder, float gain) {
+	if (hipxel_FlacDecoder_getSampleRate(decoder) != fm->sampleRate
+			|| hipxel_FlacDecoder_getOutputChannelsCount(decoder) != fm->channelsCount
+			|| hipxel_FlacDecoder_getOutputFormat(decoder) != HIPXEL_FORMAT_S16)
+		return -1;
+
+	for (int i = 0; i < HIPXEL_FLACMIXER_MAX_SOURCES; ++i) {
+		hipxel_MixerSource *s = &(fm->sources[i]);
+		if (NULL != s->decoder)
+			continue;
+
+		s->decoder = decoder;
+		s->paused = false;
+		s->exhausted = false;
+		s->gain = gain;
+		s->targetGain = gain;
+		s->gainStep = 0.0f;
+		s->rampFramesLeft = 0;
+		return i;
+	}
+
+	return -1;
+}
+
+void hipxel_FlacMixer_removeSource(hipxel_FlacMixer *fm, int index) {
+	hipxel_MixerSource *s = getSource(fm, index);
+	if (NULL == s)
+		return;
+
+	hipxel_FlacDecoder_delete(s->decoder);
+	s->decoder = NULL;
+}
+
+bool hipxel_FlacMixer_setGain(hipxel_FlacMixer *fm, int index, float gain, int64_t rampFrames) {
+	hipxel_MixerSource *s = getSource(fm, index);
+	if (NULL == s)
+		return false;
+
+	s->targetGain = gain;
+	if (rampFrames <= 0) {
+		s->gain = gain;
+		s->gainStep = 0.0f;
+		s->rampFramesLeft = 0;
+	} else {
+		s->gainStep = (gain - s->gain) / (float) rampFrames;
+		s->rampFramesLeft = rampFrames;
+	}
+	return true;
+}
+
+bool hipxel_FlacMixer_setPaused(hipxel_FlacMixer *fm, int index, bool paused) {
+	hipxel_MixerSource *s = getSource(fm, index);
+	if (NULL == s)
+		return false;
+
+	s->paused = paused;
+	return true;
+}
+
+bool hipxel_FlacMixer_seekSource(hipxel_FlacMixer *fm, int index, int64_t position, int mode) {
+	hipxel_MixerSource *s = getSource(fm, index);
+	if (NULL == s)
+		return false;
+
+	hipxel_FlacDecoder_seekTo(s->decoder, position, mode);
+	s->exhausted = false;
+	return true;
+}
+
+int64_t hipxel_FlacMixer_getSourcePosition(hipxel_FlacMixer *fm, int index) {
+	hipxel_MixerSource *s = getSource(fm, index);
+	return NULL != s ? hipxel_FlacDecoder_getPcmFramesPosition(s->decoder) : -1;
+}
+
+hipxel_FlacMixer *hipxel_FlacMixer_new(hipxel_Allocator allocator,
+		uint32_t sampleRate, uint32_t channelsCount) {
+	if (channelsCount == 0 || channelsCount > HIPXEL_FLACDECODER_MAX_CHANNELS)
+		return NULL;
+
+	hipxel_FlacMixer *fm = allocator.allocate(allocator.p, sizeof(hipxel_FlacMixer));
+	if (NULL == fm)
+		return NULL;
+
+	memset(fm, 0, sizeof(hipxel_FlacMixer));
+	hipxel_MemoryContext_init(&(fm->memory), allocator);
+	fm->sampleRate = sampleRate;
+	fm->channelsCount = channelsCount;
+
+	size_t samplesCount = (size_t) HIPXEL_FLACMIXER_CHUNK_FRAMES * channelsCount;
+	fm->mixBuffer = hipxel_MemoryContext_allocate(&(fm->memory), samplesCount * sizeof(float));
+	fm->outputBuffer = hipxel_MemoryContext_allocate(&(fm->memory), samplesCount * sizeof(int16_t));
+
+	if (NULL == fm->mixBuffer || NULL == fm->outputBuffer) {
+		hipxel_FlacMixer_delete(fm);
+		return NULL;
+	}
+
+	return fm;
+}
+
+void hipxel_FlacMixer_delete(hipxel_FlacMixer *fm) {
+	for (int i = 0; i < HIPXEL_FLACMIXER_MAX_SOURCES; ++i)
+		hipxel_FlacMixer_removeSource(fm, i);
+
+	if (NULL != fm->mixBuffer)
+		hipxel_MemoryContext_deallocate(fm->mixBuffer);
+	if (NULL != fm->outputBuffer)
+		hipxel_MemoryContext_deallocate(fm->outputBuffer);
+
+	hipxel_Allocator allocator = fm->memory.allocator;
+	allocator.deallocate(allocator.p, fm);
+}
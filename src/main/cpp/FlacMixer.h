@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_FLACMIXER
+#define HIPXEL_FLACMIXER
+
+#include "Allocator.h"
+#include "FlacDecoder.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <jni.h>
+
+#define HIPXEL_FLACMIXER_MAX_SOURCES 8
+#define HIPXEL_FLACMIXER_CHUNK_FRAMES 1024
+
+typedef struct hipxel_MixerSource {
+	hipxel_FlacDecoder *decoder;
+	bool paused;
+	bool exhausted;
+	float gain;
+	float targetGain;
+	float gainStep;
+	int64_t rampFramesLeft;
+} hipxel_MixerSource;
+
+/**
+ * Sums decoders with their own positions and gains into one interleaved int16 stream.
+ * Before every chunk is mixed, the source with least frames buffered is decoded first
+ * until all playing sources have whole chunk ready.
+ */
+typedef struct hipxel_FlacMixer {
+	hipxel_MemoryContext memory;
+	uint32_t sampleRate;
+	uint32_t channelsCount;
+
+	hipxel_MixerSource sources[HIPXEL_FLACMIXER_MAX_SOURCES];
+
+	float *mixBuffer;
+	int16_t *outputBuffer;
+} hipxel_FlacMixer;
+
+hipxel_FlacMixer *hipxel_FlacMixer_new(hipxel_Allocator allocator,
+		uint32_t sampleRate, uint32_t channelsCount);
+
+/**
+ * Deletes mixer together with decoders of all its sources.
+ */
+void hipxel_FlacMixer_delete(hipxel_FlacMixer *fm);
+
+/**
+ * Mixer takes ownership of decoder on success and returns index of its source,
+ * -1 when there is no free slot or decoder output isn't 16-bit in mixer format.
+ */
+int hipxel_FlacMixer_addSource(hipxel_FlacMixer *fm, hipxel_FlacDecoder *decoder, float gain);
+
+void hipxel_FlacMixer_removeSource(hipxel_FlacMixer *fm, int index);
+
+/**
+ * Changes gain linearly over rampFrames output frames, 0 changes it at once.
+ */
+bool hipxel_FlacMixer_setGain(hipxel_FlacMixer *fm, int index, float gain, int64_t rampFrames);
+
+/**
+ * Paused source isn't decoded nor mixed and keeps its position.
+ */
+bool hipxel_FlacMixer_setPaused(hipxel_FlacMixer *fm, int index, bool paused);
+
+bool hipxel_FlacMixer_seekSource(hipxel_FlacMixer *fm, int index, int64_t position, int mode);
+
+int64_t hipxel_FlacMixer_getSourcePosition(hipxel_FlacMixer *fm, int index);
+
+/**
+ * Decodes one frame of playing source with least frames buffered, as long as
+ * it has fewer than framesAhead. Returns false when no source needed decoding.
+ */
+bool hipxel_FlacMixer_step(hipxel_FlacMixer *fm, int64_t framesAhead);
+
+/**
+ * Mixes up to framesCount frames, finished sources are padded with silence.
+ * Returns 0 once every source is finished and drained.
+ */
+int64_t hipxel_FlacMixer_mix(hipxel_FlacMixer *fm, int16_t *dst, int64_t framesCount);
+
+jlong hipxel_FlacMixer_readJni(hipxel_FlacMixer *fm,
+		JNIEnv *env, jbyteArray buffer, jlong length);
+
+#endif // HIPXEL_FLACMIXER
@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FlacStream.h"
+
+#include <android/log.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HIPXEL_LOG_ERROR(...) \
+    ((void)__android_log_print(ANDROID_LOG_ERROR, "FlacStream", __VA_ARGS__))
+
+#define BLOCK_SIZE HIPXEL_FLACSTREAM_BLOCK_SIZE
+#define MIN_BLOCKS_COUNT 2
+
+#define METADATA_LAST_FLAG 0x80
+#define METADATA_TYPE_MASK 0x7F
+#define METADATA_TYPE_STREAMINFO 0
+#define METADATA_TYPE_SEEKTABLE 3
+#define METADATA_TYPE_VORBIS_COMMENT 4
+#define METADATA_TYPE_INVALID 127
+
+static bool readFully(hipxel_DataReader *reader, int64_t position, int64_t length, void *buffer) {
+	int64_t got = 0;
+	while (got < length) {
+		int64_t r = reader->read(reader->p, position + got, length - got, (uint8_t *) buffer + got);
+		if (r <= 0)
+			return false;
+		got += r;
+	}
+	return true;
+}
+
+static bool appendHeader(hipxel_FlacStream *fs, const uint8_t *data, int64_t length) {
+	uint8_t *header = hipxel_MemoryContext_reallocate(&(fs->memory), fs->header,
+			(size_t) (fs->headerLength + length));
+	if (NULL == header)
+		return false;
+
+	fs->header = header;
+	if (NULL != data)
+		memcpy(fs->header + fs->headerLength, data, (size_t) length);
+	fs->headerLength += length;
+	return true;
+}
+
+// keeps only metadata decoder responds to, so each cursor doesn't skip through pictures again
+static bool parseHeader(hipxel_FlacStream *fs) {
+	hipxel_DataReader *reader = &(fs->upstream);
+	int64_t offset = 0;
+	uint8_t b[10];
+
+	if (!readFully(reader, 0, sizeof(b), b))
+		return false;
+
+	// libFLAC skips leading ID3v2 tag, so do the same
+	if (0 == memcmp(b, "ID3", 3)) {
+		int64_t size = (int64_t) (b[6] & 0x7F) << 21 | (b[7] & 0x7F) << 14
+				| (b[8] & 0x7F) << 7 | (b[9] & 0x7F);
+		offset = 10 + size + ((b[5] & 0x10) ? 10 : 0);
+
+		if (!readFully(reader, offset, 4, b))
+			return false;
+	}
+
+	if (0 != memcmp(b, "fLaC", 4))
+		return false;
+	offset += 4;
+
+	if (!appendHeader(fs, b, 4))
+		return false;
+
+	int64_t lastKept = -1;
+	bool last = false;
+	while (!last) {
+		uint8_t h[4];
+		if (!readFully(reader, offset, sizeof(h), h))
+			return false;
+		offset += sizeof(h);
+
+		last = (h[0] & METADATA_LAST_FLAG) != 0;
+		uint32_t type = h[0] & METADATA_TYPE_MASK;
+		int64_t length = (int64_t) h[1] << 16 | h[2] << 8 | h[3];
+
+		if (type == METADATA_TYPE_INVALID)
+			return false;
+
+		if (type == METADATA_TYPE_STREAMINFO || type == METADATA_TYPE_SEEKTABLE
+				|| type == METADATA_TYPE_VORBIS_COMMENT) {
+			int64_t position = fs->headerLength;
+			h[0] = (uint8_t) type;
+
+			if (!appendHeader(fs, h, sizeof(h)) || !appendHeader(fs, NULL, length))
+				return false;
+			if (!readFully(reader, offset, length, fs->header + position + sizeof(h)))
+				return false;
+
+			lastKept = position;
+		}
+
+		offset += length;
+	}
+
+	if (lastKept < 0)
+		return false;
+
+	fs->header[lastKept] |= METADATA_LAST_FLAG;
+	fs->firstFrameOffset = offset;
+	return true;
+}
+
+static int64_t fetch(hipxel_FlacStream *fs, int64_t index, uint8_t *data) {
+	hipxel_DataReader *reader = &(fs->upstream);
+	int64_t position = index * BLOCK_SIZE;
+	int64_t got = 0;
+
+	// upstream readers aren't meant for concurrent use, so fetches go one at a time
+	pthread_mutex_lock(&(fs->fetchMutex));
+	while (got < BLOCK_SIZE) {
+		int64_t r = reader->read(reader->p, position + got, BLOCK_SIZE - got, data + got);
+		if (r < 0) {
+			got = r;
+			break;
+		}
+		if (r == 0)
+			break;
+		got += r;
+	}
+
+	if (got >= 0 && got < BLOCK_SIZE && fs->upstreamSize < 0) {
+		int64_t size = reader->getSize(reader->p);
+		if (size >= 0) {
+			pthread_mutex_lock(&(fs->mutex));
+			fs->upstreamSize = size;
+			pthread_mutex_unlock(&(fs->mutex));
+		}
+	}
+	pthread_mutex_unlock(&(fs->fetchMutex));
+
+	return got;
+}
+
+// called with mutex held, which is dropped while block is fetched from upstream
+static hipxel_FlacStreamBlock *getBlock(hipxel_FlacStream *fs, int64_t index) {
+	hipxel_FlacStreamBlock *victim;
+
+	for (;;) {
+		hipxel_FlacStreamBlock *found = NULL;
+		victim = NULL;
+
+		for (uint32_t i = 0; i < fs->blocksCount; ++i) {
+			hipxel_FlacStreamBlock *block = &(fs->blocks[i]);
+			if (block->index == index) {
+				found = block;
+				break;
+			}
+			if (!block->loading && (NULL == victim || block->lastUse < victim->lastUse))
+				victim = block;
+		}
+
+		if (NULL != found && !found->loading) {
+			found->lastUse = ++(fs->useCounter);
+			return found;
+		}
+
+		if (NULL == found && NULL != victim)
+			break;
+
+		// someone else is fetching this block, or every block is being fetched
+		pthread_cond_wait(&(fs->loaded), &(fs->mutex));
+	}
+
+	if (NULL == victim->data) {
+		victim->data = hipxel_MemoryContext_allocate(&(fs->memory), BLOCK_SIZE);
+		if (NULL == victim->data)
+			return NULL;
+	}
+
+	victim->index = index;
+	victim->loading = true;
+
+	pthread_mutex_unlock(&(fs->mutex));
+	int64_t got = fetch(fs, index, victim->data);
+	pthread_mutex_lock(&(fs->mutex));
+
+	victim->loading = false;
+	pthread_cond_broadcast(&(fs->loaded));
+
+	if (got < 0) {
+		victim->index = -1;
+		victim->lastUse = 0;
+		return NULL;
+	}
+
+	victim->length = got;
+
+	// short read of progressive or unknown size source may only mean data isn't there yet,
+	// such block is handed to caller, who copies it under mutex, but isn't kept
+	bool complete = got == BLOCK_SIZE
+			|| (fs->upstreamSize >= 0 && index * BLOCK_SIZE + got >= fs->upstreamSize);
+	if (complete) {
+		victim->lastUse = ++(fs->useCounter);
+	} else {
+		victim->index = -1;
+		victim->lastUse = 0;
+	}
+	return victim;
+}
+
+static int64_t readFrames(hipxel_FlacStream *fs, int64_t position, int64_t length, uint8_t *buffer) {
+	int64_t done = 0;
+
+	while (done < length) {
+		int64_t offset = position + done;
+		hipxel_FlacStreamBlock *block = getBlock(fs, offset / BLOCK_SIZE);
+		if (NULL == block)
+			return done > 0 ? done : -1;
+
+		int64_t inBlock = offset % BLOCK_SIZE;
+		if (inBlock >= block->length)
+			break;
+
+		int64_t n = block->length - inBlock;
+		if (n > length - done)
+			n = length - done;
+		memcpy(buffer + done, block->data + inBlock, (size_t) n);
+		done += n;
+
+		if (block->length < BLOCK_SIZE)
+			break;
+	}
+
+	return done;
+}
+
+static int64_t cursorRead(void *p, int64_t position, int64_t length, void *buffer) {
+	hipxel_FlacStream *fs = (hipxel_FlacStream *) p;
+
+	if (position < fs->headerLength) {
+		int64_t n = fs->headerLength - position;
+		if (n > length)
+			n = length;
+		memcpy(buffer, fs->header + position, (size_t) n);
+		return n;
+	}
+
+	int64_t offset = fs->firstFrameOffset + position - fs->headerLength;
+
+	pthread_mutex_lock(&(fs->mutex));
+	int64_t ret = readFrames(fs, offset, length, (uint8_t *) buffer);
+	pthread_mutex_unlock(&(fs->mutex));
+
+	return ret;
+}
+
+static int64_t cursorGetSize(void *p) {
+	hipxel_FlacStream *fs = (hipxel_FlacStream *) p;
+
+	pthread_mutex_lock(&(fs->mutex));
+	int64_t upstreamSize = fs->upstreamSize;
+	pthread_mutex_unlock(&(fs->mutex));
+
+	if (upstreamSize < 0)
+		return -1;
+	return upstreamSize - fs->firstFrameOffset + fs->headerLength;
+}
+
+static void cursorRelease(void *p) {
+	hipxel_FlacStream_release((hipxel_FlacStream *) p);
+}
+
+static void deleteStream(hipxel_FlacStream *fs) {
+	if (NULL != fs->blocks) {
+		for (uint32_t i = 0; i < fs->blocksCount; ++i)
+			hipxel_MemoryContext_deallocate(fs->blocks[i].data);
+		hipxel_MemoryContext_deallocate(fs->blocks);
+	}
+
+	hipxel_MemoryContext_deallocate(fs->header);
+	fs->upstream.release(fs->upstream.p);
+
+	pthread_mutex_destroy(&(fs->fetchMutex));
+	pthread_cond_destroy(&(fs->loaded));
+	pthread_mutex_destroy(&(fs->mutex));
+	free(fs);
+}
+
+hipxel_FlacStream *hipxel_FlacStream_new(hipxel_DataReader reader, int64_t cacheBytes) {
+	hipxel_FlacStream *fs = malloc(sizeof(hipxel_FlacStream));
+	if (NULL == fs) {
+		reader.release(reader.p);
+		return NULL;
+	}
+
+	hipxel_MemoryContext_init(&(fs->memory), hipxel_Allocator_system());
+	pthread_mutex_init(&(fs->mutex), NULL);
+	pthread_cond_init(&(fs->loaded), NULL);
+	pthread_mutex_init(&(fs->fetchMutex), NULL);
+	fs->refCount = 1;
+
+	fs->upstream = reader;
+	fs->upstreamSize = reader.getSize(reader.p);
+
+	fs->header = NULL;
+	fs->headerLength = 0;
+	fs->firstFrameOffset = 0;
+
+	fs->useCounter = 0;
+	fs->blocksCount = (uint32_t) (cacheBytes / BLOCK_SIZE);
+	if (fs->blocksCount < MIN_BLOCKS_COUNT)
+		fs->blocksCount = MIN_BLOCKS_COUNT;
+
+	fs->blocks = hipxel_MemoryContext_allocate(&(fs->memory),
+			fs->blocksCount * sizeof(hipxel_FlacStreamBlock));
+	if (NULL != fs->blocks) {
+		memset(fs->blocks, 0, fs->blocksCount * sizeof(hipxel_FlacStreamBlock));
+		for (uint32_t i = 0; i < fs->blocksCount; ++i)
+			fs->blocks[i].index = -1;
+	}
+
+	if (NULL == fs->blocks || !parseHeader(fs)) {
+		HIPXEL_LOG_ERROR("couldn't read FLAC metadata");
+		deleteStream(fs);
+		return NULL;
+	}
+
+	return fs;
+}
+
+hipxel_DataReader hipxel_FlacStream_openCursor(hipxel_FlacStream *fs) {
+	pthread_mutex_lock(&(fs->mutex));
+	++(fs->refCount);
+	pthread_mutex_unlock(&(fs->mutex));
+
+	hipxel_DataReader v;
+	v.read = cursorRead;
+	v.getSize = cursorGetSize;
+	v.release = cursorRelease;
+	v.p = fs;
+	return v;
+}
+
+void hipxel_FlacStream_release(hipxel_FlacStream *fs) {
+	pthread_mutex_lock(&(fs->mutex));
+	int32_t refCount = --(fs->refCount);
+	pthread_mutex_unlock(&(fs->mutex));
+
+	if (refCount == 0)
+		deleteStream(fs);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_FLACSTREAM
+#define HIPXEL_FLACSTREAM
+
+#include "Allocator.h"
+#include "DataReader.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define HIPXEL_FLACSTREAM_BLOCK_SIZE (64 * 1024)
+
+typedef struct hipxel_FlacStreamBlock {
+	int64_t index;
+	int64_t length;
+	uint64_t lastUse;
+	bool loading;
+	uint8_t *data;
+} hipxel_FlacStreamBlock;
+
+/**
+ * One source shared by many decoders. Metadata is parsed once and kept as compact
+ * header with only blocks decoders respond to, frames are read through shared
+ * block cache. All methods are thread safe, upstream is read outside of mutex
+ * so cursors hitting cached blocks don't wait for slow fetches.
+ */
+typedef struct hipxel_FlacStream {
+	hipxel_MemoryContext memory;
+	pthread_mutex_t mutex;
+	pthread_cond_t loaded;
+	pthread_mutex_t fetchMutex;
+	int32_t refCount;
+
+	hipxel_DataReader upstream;
+	int64_t upstreamSize;
+
+	uint8_t *header;
+	int64_t headerLength;
+	int64_t firstFrameOffset;
+
+	hipxel_FlacStreamBlock *blocks;
+	uint32_t blocksCount;
+	uint64_t useCounter;
+} hipxel_FlacStream;
+
+/**
+ * Takes ownership of reader, keeps up to cacheBytes of frame data.
+ * Returns NULL if source doesn't look like FLAC.
+ */
+hipxel_FlacStream *hipxel_FlacStream_new(hipxel_DataReader reader, int64_t cacheBytes);
+
+/**
+ * Reader for one more decoder over this stream, it shows header followed by frames
+ * and keeps stream alive until released.
+ */
+hipxel_DataReader hipxel_FlacStream_openCursor(hipxel_FlacStream *fs);
+
+void hipxel_FlacStream_release(hipxel_FlacStream *fs);
+
+#endif // HIPXEL_FLACSTREAM
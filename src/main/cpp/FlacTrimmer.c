@@ -0,0 +1,707 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FlacTrimmer.h"
+
+#include "Allocator.h"
+#include "FrameScanner.h"
+
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
+#include <private/crc.h>
+
+#include <android/log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIPXEL_LOG_ERROR(...) \
+    ((void)__android_log_print(ANDROID_LOG_ERROR, "FlacTrimmer", __VA_ARGS__))
+
+#define STREAMINFO_LENGTH 34
+#define SEEKPOINT_LENGTH 18
+#define SEEKPOINT_INTERVAL_SECONDS 10
+#define METADATA_HEADER_LENGTH 4
+#define METADATA_LAST_FLAG 0x80
+#define METADATA_TYPE_STREAMINFO 0
+#define METADATA_TYPE_SEEKTABLE 3
+#define METADATA_TYPE_VORBIS_COMMENT 4
+#define MAX_NUMBER_LENGTH 7
+#define ENCODE_COMPRESSION_LEVEL 5
+
+typedef struct hipxel_TrimSeekPoint {
+	int64_t sampleNumber;
+	int64_t offset;
+	uint32_t blockSize;
+} hipxel_TrimSeekPoint;
+
+typedef struct hipxel_FlacTrimmer {
+	hipxel_FlacStream *stream;
+	hipxel_DataReader reader;
+	int64_t sourceLength;
+	hipxel_MemoryContext memory;
+	hipxel_FrameScanner scanner;
+
+	FLAC__StreamDecoder *decoder;
+	int64_t currentOffset;
+	bool endOfFile;
+	int64_t decodedSampleNumber;
+
+	// samples waiting for encoder, planar
+	int32_t *pending[FLAC__MAX_CHANNELS];
+	uint32_t pendingCount;
+	uint32_t pendingCapacity;
+	int64_t keepFrom;
+	int64_t keepTo;
+
+	uint8_t *frame;
+	int64_t frameCapacity;
+
+	FILE *out;
+	bool failed;
+	int64_t firstFrameOffset;
+	int64_t outputOffset;
+	int64_t outputSamples;
+
+	uint32_t minBlockSize;
+	uint32_t maxBlockSize;
+	uint32_t lastBlockSize;
+	uint32_t minFrameSize;
+	uint32_t maxFrameSize;
+
+	hipxel_TrimSeekPoint *seekPoints;
+	uint32_t seekPointsCount;
+	uint32_t seekPointsUsed;
+	int64_t seekPointInterval;
+	int64_t nextSeekPointSample;
+} hipxel_FlacTrimmer;
+
+static void putBigEndian(uint8_t *dst, uint64_t v, uint32_t bytes) {
+	for (uint32_t i = 0; i < bytes; ++i)
+		dst[i] = (uint8_t) (v >> (8 * (bytes - 1 - i)));
+}
+
+static bool ensureFrameCapacity(hipxel_FlacTrimmer *t, int64_t capacity) {
+	if (capacity <= t->frameCapacity)
+		return true;
+
+	uint8_t *frame = realloc(t->frame, (size_t) capacity);
+	if (NULL == frame)
+		return false;
+
+	t->frame = frame;
+	t->frameCapacity = capacity;
+	return true;
+}
+
+static bool readFully(hipxel_FlacTrimmer *t, int64_t position, int64_t length, uint8_t *buffer) {
+	int64_t got = 0;
+	while (got < length) {
+		int64_t r = t->reader.read(t->reader.p, position + got, length - got, buffer + got);
+		if (r <= 0)
+			return false;
+		got += r;
+	}
+	return true;
+}
+
+static uint32_t encodeNumber(uint8_t *dst, uint64_t v) {
+	if (v < 0x80) {
+		dst[0] = (uint8_t) v;
+		return 1;
+	}
+
+	uint32_t n = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4
+			: v < 0x4000000 ? 5 : v < 0x80000000 ? 6 : 7;
+	for (uint32_t i = n - 1; i > 0; --i) {
+		dst[i] = (uint8_t) (0x80 | (v & 0x3F));
+		v >>= 6;
+	}
+	dst[0] = (uint8_t) (((0xFF00 >> n) & 0xFF) | v);
+	return n;
+}
+
+static uint32_t numberLength(uint8_t first) {
+	uint32_t n = 0;
+	while (n < 8 && (first & (0x80 >> n)))
+		++n;
+	return n == 0 ? 1 : n;
+}
+
+/**
+ * Writes frame with header switched to variable block size and numbered by output
+ * sample position, header and frame CRCs are computed again.
+ */
+static void writeFrame(hipxel_FlacTrimmer *t, const uint8_t *frame, int64_t length,
+                       uint32_t headerLength, uint32_t blockSize) {
+	if (t->failed)
+		return;
+
+	uint32_t oldNumberLength = numberLength(frame[4]);
+	uint32_t extraLength = headerLength - 5 - oldNumberLength;
+	int64_t bodyLength = length - headerLength - 2;
+
+	uint8_t header[HIPXEL_FRAMESCANNER_MAX_HEADER_LENGTH];
+	header[0] = 0xFF;
+	header[1] = 0xF9;
+	header[2] = frame[2];
+	header[3] = frame[3];
+	uint32_t pos = 4 + encodeNumber(header + 4, (uint64_t) t->outputSamples);
+	memcpy(header + pos, frame + 4 + oldNumberLength, extraLength);
+	pos += extraLength;
+	header[pos] = FLAC__crc8(header, pos);
+	++pos;
+
+	int64_t newLength = pos + bodyLength + 2;
+	bool inPlace = frame == t->frame;
+	if (!ensureFrameCapacity(t, newLength)) {
+		t->failed = true;
+		return;
+	}
+	if (inPlace)
+		frame = t->frame;
+
+	// frame may already live in t->frame, move body before header overwrites it
+	memmove(t->frame + pos, frame + headerLength, (size_t) bodyLength);
+	memcpy(t->frame, header, pos);
+	unsigned crc = FLAC__crc16(t->frame, (unsigned) (newLength - 2)) & 0xFFFF;
+	t->frame[newLength - 2] = (uint8_t) (crc >> 8);
+	t->frame[newLength - 1] = (uint8_t) crc;
+
+	if (fwrite(t->frame, 1, (size_t) newLength, t->out) != (size_t) newLength) {
+		t->failed = true;
+		return;
+	}
+
+	int64_t endSample = t->outputSamples + blockSize;
+
+	// one point per interval, pointing at frame holding its sample
+	if (t->seekPointsUsed < t->seekPointsCount && t->nextSeekPointSample < endSample) {
+		hipxel_TrimSeekPoint *point = &(t->seekPoints[t->seekPointsUsed++]);
+		point->sampleNumber = t->outputSamples;
+		point->offset = t->outputOffset;
+		point->blockSize = blockSize;
+
+		while (t->nextSeekPointSample < endSample)
+			t->nextSeekPointSample += t->seekPointInterval;
+	}
+
+	// minimum block size doesn't count the last frame
+	if (t->lastBlockSize != 0 && t->lastBlockSize < t->minBlockSize)
+		t->minBlockSize = t->lastBlockSize;
+	t->lastBlockSize = blockSize;
+	if (blockSize > t->maxBlockSize)
+		t->maxBlockSize = blockSize;
+	if (newLength < t->minFrameSize)
+		t->minFrameSize = (uint32_t) newLength;
+	if (newLength > t->maxFrameSize)
+		t->maxFrameSize = (uint32_t) newLength;
+
+	t->outputOffset += newLength;
+	t->outputSamples = endSample;
+}
+
+static unsigned crc16Update(unsigned crc, uint8_t byte) {
+	crc ^= (unsigned) byte << 8;
+	for (int i = 0; i < 8; ++i)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+	return crc & 0xFFFF;
+}
+
+/**
+ * Last frame ends where its CRC-16 validates, trailing ID3v1 or APE tag may follow it.
+ * Farthest such end is taken, length is 0 when there's none.
+ */
+static bool measureLastFrame(hipxel_FlacTrimmer *t, const hipxel_FrameHeader *frame,
+                             int64_t *outLength) {
+	int64_t length = t->sourceLength - frame->offset;
+	if (length < frame->headerLength + 2 || !ensureFrameCapacity(t, length)
+			|| !readFully(t, frame->offset, length, t->frame))
+		return false;
+
+	const uint8_t *b = t->frame;
+	int64_t end = 0;
+	unsigned crc = 0;
+	for (int64_t i = 0; i + 2 <= length; ++i) {
+		if (i >= frame->headerLength && crc == ((unsigned) b[i] << 8 | b[i + 1]))
+			end = i + 2;
+		crc = crc16Update(crc, b[i]);
+	}
+
+	*outLength = end;
+	return true;
+}
+
+/**
+ * Finds frame following given one and length of given one, which is confirmed by CRC-16.
+ * Length of last frame is 0 if it couldn't be confirmed.
+ */
+static bool measureFrame(hipxel_FlacTrimmer *t, const hipxel_FrameHeader *frame,
+                         int64_t *outLength, hipxel_FrameHeader *outNext, bool *outHasNext) {
+	int64_t from = frame->offset + frame->headerLength;
+	int64_t expected = frame->sampleNumber + frame->blockSize;
+	hipxel_FrameHeader next;
+
+	while (hipxel_FrameScanner_findNext(&(t->scanner), from, t->sourceLength, &next)) {
+		from = next.offset + 1;
+		if (next.sampleNumber != expected)
+			continue;
+
+		int64_t length = next.offset - frame->offset;
+		if (!ensureFrameCapacity(t, length) || !readFully(t, frame->offset, length, t->frame))
+			return false;
+
+		unsigned crc = FLAC__crc16(t->frame, (unsigned) (length - 2)) & 0xFFFF;
+		if (crc != ((unsigned) t->frame[length - 2] << 8 | t->frame[length - 1]))
+			continue;
+
+		*outLength = length;
+		*outNext = next;
+		*outHasNext = true;
+		return true;
+	}
+
+	*outHasNext = false;
+	return measureLastFrame(t, frame, outLength);
+}
+
+static FLAC__StreamDecoderReadStatus readCallback(
+		const FLAC__StreamDecoder *decoder,
+		FLAC__byte buffer[], size_t *bytes,
+		void *client_data) {
+	hipxel_FlacTrimmer *t = (hipxel_FlacTrimmer *) client_data;
+
+	int64_t got = t->reader.read(t->reader.p, t->currentOffset, *bytes, buffer);
+	if (got < 0) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+	}
+
+	if (0 == got) {
+		*bytes = 0;
+		t->endOfFile = true;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+
+	*bytes = (size_t) got;
+	t->currentOffset += got;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__bool eofCallback(
+		const FLAC__StreamDecoder *decoder,
+		void *client_data) {
+	hipxel_FlacTrimmer *t = (hipxel_FlacTrimmer *) client_data;
+	return t->endOfFile;
+}
+
+static bool ensurePendingCapacity(hipxel_FlacTrimmer *t, uint32_t capacity) {
+	if (capacity <= t->pendingCapacity)
+		return true;
+
+	for (uint32_t c = 0; c < t->scanner.info.channelsCount; ++c) {
+		int32_t *p = realloc(t->pending[c], capacity * sizeof(int32_t));
+		if (NULL == p)
+			return false;
+		t->pending[c] = p;
+	}
+	t->pendingCapacity = capacity;
+	return true;
+}
+
+static FLAC__StreamDecoderWriteStatus writeCallback(
+		const FLAC__StreamDecoder *decoder,
+		const FLAC__Frame *frame, const FLAC__int32 *const buffer[],
+		void *client_data) {
+	hipxel_FlacTrimmer *t = (hipxel_FlacTrimmer *) client_data;
+
+	int64_t sampleNumber = (int64_t) frame->header.number.sample_number;
+	t->decodedSampleNumber = sampleNumber;
+
+	int64_t from = t->keepFrom > sampleNumber ? t->keepFrom - sampleNumber : 0;
+	int64_t to = t->keepTo - sampleNumber;
+	if (to > frame->header.blocksize)
+		to = frame->header.blocksize;
+	if (to <= from)
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+
+	uint32_t count = (uint32_t) (to - from);
+	if (!ensurePendingCapacity(t, t->pendingCount + count))
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+	for (uint32_t c = 0; c < t->scanner.info.channelsCount; ++c)
+		memcpy(t->pending[c] + t->pendingCount, buffer[c] + from, count * sizeof(int32_t));
+	t->pendingCount += count;
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void errorCallback(
+		const FLAC__StreamDecoder *decoder,
+		FLAC__StreamDecoderErrorStatus status,
+		void *client_data) {
+	HIPXEL_LOG_ERROR("got error from FLAC decoder: %d", (int) status);
+}
+
+// appends samples of frame within [keepFrom, keepTo) to pending
+static bool decodeFrame(hipxel_FlacTrimmer *t, const hipxel_FrameHeader *frame) {
+	if (!FLAC__stream_decoder_flush(t->decoder))
+		return false;
+
+	t->currentOffset = frame->offset;
+	t->endOfFile = false;
+	t->decodedSampleNumber = -1;
+
+	return FLAC__stream_decoder_process_single(t->decoder)
+			&& t->decodedSampleNumber == frame->sampleNumber;
+}
+
+static FLAC__StreamEncoderWriteStatus encoderWriteCallback(
+		const FLAC__StreamEncoder *encoder,
+		const FLAC__byte buffer[], size_t bytes,
+		unsigned samples, unsigned current_frame,
+		void *client_data) {
+	hipxel_FlacTrimmer *t = (hipxel_FlacTrimmer *) client_data;
+
+	// "fLaC" and STREAMINFO of encoder's own stream
+	if (samples == 0)
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+	hipxel_FrameHeader header;
+	if (!hipxel_FrameScanner_parseHeader(&(t->scanner), buffer, (int64_t) bytes, &header)) {
+		t->failed = true;
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+	}
+
+	writeFrame(t, buffer, (int64_t) bytes, header.headerLength, samples);
+	return t->failed ? FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR
+			: FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static bool encodePending(hipxel_FlacTrimmer *t) {
+	if (t->pendingCount == 0)
+		return true;
+
+	FLAC__StreamEncoder *encoder = FLAC__stream_encoder_new();
+	if (NULL == encoder)
+		return false;
+
+	// one frame of all pending samples, or two of at least minimum size when they don't fit,
+	// so short frame never lands mid-stream. Fewer than minimum only happen at stream end.
+	uint32_t blockSize = t->pendingCount;
+	if (blockSize > FLAC__MAX_BLOCK_SIZE)
+		blockSize = (blockSize + 1) / 2;
+	if (blockSize < FLAC__MIN_BLOCK_SIZE)
+		blockSize = FLAC__MIN_BLOCK_SIZE;
+
+	FLAC__stream_encoder_set_streamable_subset(encoder, false);
+	FLAC__stream_encoder_set_channels(encoder, t->scanner.info.channelsCount);
+	FLAC__stream_encoder_set_bits_per_sample(encoder, t->scanner.info.bitsPerSample);
+	FLAC__stream_encoder_set_sample_rate(encoder, t->scanner.info.sampleRate);
+	FLAC__stream_encoder_set_compression_level(encoder, ENCODE_COMPRESSION_LEVEL);
+	FLAC__stream_encoder_set_blocksize(encoder, blockSize);
+	FLAC__stream_encoder_set_do_md5(encoder, false);
+	FLAC__stream_encoder_set_total_samples_estimate(encoder, t->pendingCount);
+
+	bool ok = FLAC__stream_encoder_init_stream(encoder, encoderWriteCallback,
+			NULL, NULL, NULL, t) == FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+	if (ok)
+		ok = FLAC__stream_encoder_process(encoder,
+				(const FLAC__int32 *const *) t->pending, t->pendingCount);
+	if (ok)
+		ok = FLAC__stream_encoder_finish(encoder);
+
+	FLAC__stream_encoder_delete(encoder);
+
+	t->pendingCount = 0;
+	return ok && !t->failed;
+}
+
+static int64_t frameEnd(const hipxel_FrameHeader *frame) {
+	return frame->sampleNumber + frame->blockSize;
+}
+
+static bool writeFrames(hipxel_FlacTrimmer *t, int64_t start, int64_t end) {
+	hipxel_FrameHeader frame, next;
+	int64_t length;
+	bool hasFrame = hipxel_FrameScanner_locate(&(t->scanner), start, &frame);
+	bool hasNext;
+
+	t->keepFrom = start;
+	t->keepTo = end;
+
+	// partial first frame, extended until encoded block is long enough
+	if (hasFrame && (frame.sampleNumber < start || end < frameEnd(&frame))) {
+		while (hasFrame && frame.sampleNumber < end) {
+			if (!decodeFrame(t, &frame) || !measureFrame(t, &frame, &length, &next, &hasNext))
+				return false;
+			hasFrame = hasNext;
+			frame = next;
+
+			if (t->pendingCount >= FLAC__MIN_BLOCK_SIZE)
+				break;
+		}
+		if (!encodePending(t))
+			return false;
+	}
+
+	// whole frames are copied
+	while (hasFrame && frameEnd(&frame) <= end) {
+		if (!measureFrame(t, &frame, &length, &next, &hasNext))
+			return false;
+
+		// last frame with unconfirmed end is encoded again instead of copied with garbage
+		if (length == 0) {
+			if (!decodeFrame(t, &frame) || !encodePending(t))
+				return false;
+		} else {
+			writeFrame(t, t->frame, length, frame.headerLength, frame.blockSize);
+		}
+		if (t->failed)
+			return false;
+
+		hasFrame = hasNext;
+		frame = next;
+	}
+
+	// partial last frame
+	if (hasFrame && frame.sampleNumber < end) {
+		if (!decodeFrame(t, &frame) || !encodePending(t))
+			return false;
+	}
+
+	return t->outputSamples == end - start;
+}
+
+static const uint8_t *findMetadata(hipxel_FlacStream *stream, uint32_t type, uint32_t *outLength) {
+	int64_t pos = 4;
+	while (pos + METADATA_HEADER_LENGTH <= stream->headerLength) {
+		const uint8_t *h = stream->header + pos;
+		uint32_t length = (uint32_t) h[1] << 16 | (uint32_t) h[2] << 8 | h[3];
+		if ((h[0] & ~METADATA_LAST_FLAG) == type) {
+			*outLength = length;
+			return h + METADATA_HEADER_LENGTH;
+		}
+		pos += METADATA_HEADER_LENGTH + length;
+	}
+	return NULL;
+}
+
+static bool writeMetadataHeader(hipxel_FlacTrimmer *t, uint32_t type, bool last, uint32_t length) {
+	uint8_t h[METADATA_HEADER_LENGTH];
+	h[0] = (uint8_t) (type | (last ? METADATA_LAST_FLAG : 0));
+	putBigEndian(h + 1, length, 3);
+	return fwrite(h, 1, sizeof(h), t->out) == sizeof(h);
+}
+
+static void packStreamInfo(hipxel_FlacTrimmer *t, uint8_t *dst) {
+	hipxel_FrameScanner *fs = &(t->scanner);
+
+	// single frame stream has no frame excluded from minimum
+	uint32_t minBlockSize = t->minBlockSize;
+	if (minBlockSize == UINT32_MAX)
+		minBlockSize = t->lastBlockSize;
+
+	putBigEndian(dst, minBlockSize, 2);
+	putBigEndian(dst + 2, t->maxBlockSize, 2);
+	putBigEndian(dst + 4, t->minFrameSize == UINT32_MAX ? 0 : t->minFrameSize, 3);
+	putBigEndian(dst + 7, t->maxFrameSize, 3);
+
+	uint64_t v = (uint64_t) fs->info.sampleRate << 44
+			| (uint64_t) (fs->info.channelsCount - 1) << 41
+			| (uint64_t) (fs->info.bitsPerSample - 1) << 36
+			| (uint64_t) t->outputSamples;
+	putBigEndian(dst + 10, v, 8);
+
+	// MD5 of output is unknown without decoding all of it
+	memset(dst + 18, 0, 16);
+}
+
+static bool writeHeader(hipxel_FlacTrimmer *t, int64_t samplesCount) {
+	uint32_t commentLength = 0;
+	const uint8_t *comment = findMetadata(t->stream, METADATA_TYPE_VORBIS_COMMENT, &commentLength);
+
+	t->seekPointInterval = (int64_t) SEEKPOINT_INTERVAL_SECONDS * t->scanner.info.sampleRate;
+	t->seekPointsCount = (uint32_t) ((samplesCount + t->seekPointInterval - 1) / t->seekPointInterval);
+	if (t->seekPointsCount > 0) {
+		t->seekPoints = calloc(t->seekPointsCount, sizeof(hipxel_TrimSeekPoint));
+		if (NULL == t->seekPoints)
+			return false;
+	}
+
+	uint8_t streamInfo[STREAMINFO_LENGTH];
+	memset(streamInfo, 0, sizeof(streamInfo));
+
+	bool ok = fwrite("fLaC", 1, 4, t->out) == 4
+			&& writeMetadataHeader(t, METADATA_TYPE_STREAMINFO,
+					t->seekPointsCount == 0 && NULL == comment, STREAMINFO_LENGTH)
+			&& fwrite(streamInfo, 1, sizeof(streamInfo), t->out) == sizeof(streamInfo);
+
+	// seek table space is reserved now and filled once frame offsets are known
+	if (ok && t->seekPointsCount > 0) {
+		uint32_t length = t->seekPointsCount * SEEKPOINT_LENGTH;
+		ok = writeMetadataHeader(t, METADATA_TYPE_SEEKTABLE, NULL == comment, length);
+		for (uint32_t i = 0; ok && i < length; ++i)
+			ok = fputc(0, t->out) != EOF;
+	}
+
+	if (ok && NULL != comment) {
+		ok = writeMetadataHeader(t, METADATA_TYPE_VORBIS_COMMENT, true, commentLength)
+				&& fwrite(comment, 1, commentLength, t->out) == commentLength;
+	}
+
+	t->firstFrameOffset = ftell(t->out);
+	return ok;
+}
+
+static bool finishHeader(hipxel_FlacTrimmer *t) {
+	uint8_t streamInfo[STREAMINFO_LENGTH];
+	packStreamInfo(t, streamInfo);
+
+	if (fseek(t->out, 4 + METADATA_HEADER_LENGTH, SEEK_SET) != 0
+			|| fwrite(streamInfo, 1, sizeof(streamInfo), t->out) != sizeof(streamInfo))
+		return false;
+
+	if (t->seekPointsCount == 0)
+		return true;
+
+	if (fseek(t->out, METADATA_HEADER_LENGTH, SEEK_CUR) != 0)
+		return false;
+
+	// intervals falling into one frame share point, unused slots are placeholders
+	for (uint32_t i = 0; i < t->seekPointsCount; ++i) {
+		uint8_t p[SEEKPOINT_LENGTH];
+		if (i < t->seekPointsUsed) {
+			putBigEndian(p, (uint64_t) t->seekPoints[i].sampleNumber, 8);
+			putBigEndian(p + 8, (uint64_t) t->seekPoints[i].offset, 8);
+			putBigEndian(p + 16, t->seekPoints[i].blockSize, 2);
+		} else {
+			putBigEndian(p, FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER, 8);
+			memset(p + 8, 0, 10);
+		}
+		if (fwrite(p, 1, sizeof(p), t->out) != sizeof(p))
+			return false;
+	}
+	return true;
+}
+
+static bool openDecoder(hipxel_FlacTrimmer *t) {
+	t->decoder = FLAC__stream_decoder_new();
+	if (NULL == t->decoder)
+		return false;
+
+	FLAC__stream_decoder_set_md5_checking(t->decoder, false);
+	FLAC__stream_decoder_set_metadata_ignore_all(t->decoder);
+
+	FLAC__StreamDecoderInitStatus initStatus = FLAC__stream_decoder_init_stream(
+			t->decoder,
+			readCallback, NULL, NULL, NULL, eofCallback, writeCallback,
+			NULL, errorCallback,
+			(void *) t);
+
+	return initStatus == FLAC__STREAM_DECODER_INIT_STATUS_OK
+			&& FLAC__stream_decoder_process_until_end_of_metadata(t->decoder);
+}
+
+static bool readStreamInfo(hipxel_FlacTrimmer *t) {
+	uint32_t length = 0;
+	const uint8_t *si = findMetadata(t->stream, METADATA_TYPE_STREAMINFO, &length);
+	if (NULL == si || length < STREAMINFO_LENGTH)
+		return false;
+
+	hipxel_FrameScanner *fs = &(t->scanner);
+	fs->sourceLength = t->sourceLength;
+	fs->firstFrameOffset = t->stream->headerLength;
+	fs->info.minBlockSize = (uint32_t) si[0] << 8 | si[1];
+	fs->info.maxBlockSize = (uint32_t) si[2] << 8 | si[3];
+	fs->info.maxFrameSize = (uint32_t) si[7] << 16 | (uint32_t) si[8] << 8 | si[9];
+	fs->info.sampleRate = (uint32_t) si[10] << 12 | (uint32_t) si[11] << 4 | si[12] >> 4;
+	fs->info.channelsCount = ((si[12] >> 1) & 0x07) + 1u;
+	fs->info.bitsPerSample = (((uint32_t) si[12] & 1) << 4 | si[13] >> 4) + 1u;
+	fs->info.totalSamplesCount = (uint64_t) (si[13] & 0x0F) << 32
+			| (uint64_t) si[14] << 24 | (uint64_t) si[15] << 16
+			| (uint64_t) si[16] << 8 | si[17];
+
+	return fs->info.sampleRate != 0 && fs->info.totalSamplesCount != 0;
+}
+
+static void release(hipxel_FlacTrimmer *t) {
+	if (NULL != t->decoder)
+		FLAC__stream_decoder_delete(t->decoder);
+
+	hipxel_FrameScanner_release(&(t->scanner));
+	t->reader.release(t->reader.p);
+
+	for (uint32_t c = 0; c < FLAC__MAX_CHANNELS; ++c)
+		free(t->pending[c]);
+	free(t->frame);
+	free(t->seekPoints);
+
+	if (NULL != t->out)
+		fclose(t->out);
+}
+
+bool hipxel_FlacTrimmer_trim(hipxel_FlacStream *stream, const char *outputPath,
+		int64_t startSample, int64_t endSample) {
+	hipxel_FlacTrimmer t;
+	memset(&t, 0, sizeof(t));
+
+	t.stream = stream;
+	t.reader = hipxel_FlacStream_openCursor(stream);
+	t.sourceLength = t.reader.getSize(t.reader.p);
+	t.minBlockSize = UINT32_MAX;
+	t.minFrameSize = UINT32_MAX;
+
+	hipxel_MemoryContext_init(&(t.memory), hipxel_Allocator_system());
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(&(t.memory));
+	hipxel_FrameScanner_init(&(t.scanner), &(t.reader), &(t.memory));
+
+	bool ok = t.sourceLength >= 0 && readStreamInfo(&t);
+	if (!ok)
+		HIPXEL_LOG_ERROR("trimming needs stream with known length and samples count");
+
+	int64_t totalSamplesCount = (int64_t) t.scanner.info.totalSamplesCount;
+	if (endSample > totalSamplesCount)
+		endSample = totalSamplesCount;
+	if (startSample < 0)
+		startSample = 0;
+
+	ok = ok && startSample < endSample && openDecoder(&t);
+
+	if (ok) {
+		t.out = fopen(outputPath, "w+b");
+		ok = NULL != t.out;
+	}
+
+	ok = ok && writeHeader(&t, endSample - startSample);
+	ok = ok && writeFrames(&t, startSample, endSample);
+	ok = ok && finishHeader(&t);
+
+	if (NULL != t.out) {
+		ok = fclose(t.out) == 0 && ok;
+		t.out = NULL;
+		if (!ok)
+			remove(outputPath);
+	}
+
+	release(&t);
+	hipxel_MemoryContext_bind(previous);
+
+	if (!ok)
+		HIPXEL_LOG_ERROR("couldn't trim to %s", outputPath);
+	return ok;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_FLACTRIMMER
+#define HIPXEL_FLACTRIMMER
+
+#include "FlacStream.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Writes samples [startSample, endSample) of stream to new FLAC file. Frames fully
+ * inside range are copied with renumbered headers, only partial frames at both ends
+ * are decoded and encoded again. Output uses variable block size numbering and
+ * has no MD5 signature.
+ */
+bool hipxel_FlacTrimmer_trim(hipxel_FlacStream *stream, const char *outputPath,
+		int64_t startSample, int64_t endSample);
+
+#endif // HIPXEL_FLACTRIMMER
@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FramePipeline.h"
+
+#include "Allocator.h"
+
+#include <FLAC/stream_decoder.h>
+#include <private/crc.h>
+
+#include <android/log.h>
+
+#include <string.h>
+
+#define HIPXEL_LOG_ERROR(...) \
+    ((void)__android_log_print(ANDROID_LOG_ERROR, "FramePipeline", __VA_ARGS__))
+
+#define SLOT_EMPTY 0
+#define SLOT_QUEUED 1
+#define SLOT_DECODING 2
+#define SLOT_DONE 3
+#define SLOT_FAILED 4
+
+#define INPUT_CHUNK (64 * 1024)
+
+// 65535 samples of 8 channels of 32 bits, used when STREAMINFO doesn't know max frame size
+#define MAX_FRAME_LENGTH (65535 * 8 * 4 + 1024)
+
+static void putBigEndian(uint8_t *dst, uint64_t v, uint32_t bytes) {
+	for (uint32_t i = 0; i < bytes; ++i)
+		dst[i] = (uint8_t) (v >> (8 * (bytes - 1 - i)));
+}
+
+// "fLaC" and STREAMINFO marked as last block, enough for libFLAC to decode single frames
+static void packStreamInfo(hipxel_FramePipeline *fp) {
+	hipxel_FrameScanner *fs = fp->scanner;
+	uint8_t *d = fp->streamInfo;
+
+	memcpy(d, "fLaC", 4);
+	d[4] = 0x80;
+	putBigEndian(d + 5, 34, 3);
+	putBigEndian(d + 8, fs->info.minBlockSize, 2);
+	putBigEndian(d + 10, fs->info.maxBlockSize, 2);
+	putBigEndian(d + 12, 0, 3);
+	putBigEndian(d + 15, fs->info.maxFrameSize, 3);
+
+	uint64_t v = (uint64_t) fs->info.sampleRate << 44
+			| (uint64_t) (fs->info.channelsCount - 1) << 41
+			| (uint64_t) (fs->info.bitsPerSample - 1) << 36
+			| (fs->info.totalSamplesCount & 0xFFFFFFFFFull);
+	putBigEndian(d + 18, v, 8);
+	memset(d + 26, 0, 16);
+}
+
+static FLAC__StreamDecoderReadStatus readCallback(
+		const FLAC__StreamDecoder *decoder,
+		FLAC__byte buffer[], size_t *bytes,
+		void *client_data) {
+	hipxel_PipelineWorker *w = (hipxel_PipelineWorker *) client_data;
+
+	int64_t left = w->inputLength - w->inputPosition;
+	if (left <= 0) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+
+	if ((int64_t) *bytes > left)
+		*bytes = (size_t) left;
+
+	memcpy(buffer, w->input + w->inputPosition, *bytes);
+	w->inputPosition += *bytes;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__bool eofCallback(
+		const FLAC__StreamDecoder *decoder,
+		void *client_data) {
+	hipxel_PipelineWorker *w = (hipxel_PipelineWorker *) client_data;
+	return w->inputPosition >= w->inputLength;
+}
+
+static FLAC__StreamDecoderWriteStatus writeCallback(
+		const FLAC__StreamDecoder *decoder,
+		const FLAC__Frame *frame, const FLAC__int32 *const buffer[],
+		void *client_data) {
+	hipxel_PipelineWorker *w = (hipxel_PipelineWorker *) client_data;
+	hipxel_PipelineSlot *slot = w->slot;
+	hipxel_FrameScanner *fs = w->pipeline->scanner;
+
+	uint32_t framesCount = frame->header.blocksize;
+	if (framesCount > fs->info.maxBlockSize || frame->header.channels != fs->info.channelsCount)
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+	for (uint32_t c = 0; c < fs->info.channelsCount; ++c)
+		memcpy(slot->samples[c], buffer[c], framesCount * sizeof(int32_t));
+	slot->framesCount = framesCount;
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void errorCallback(
+		const FLAC__StreamDecoder *decoder,
+		FLAC__StreamDecoderErrorStatus status,
+		void *client_data) {
+	HIPXEL_LOG_ERROR("got error from FLAC decoder: %d", (int) status);
+}
+
+static FLAC__StreamDecoder *openDecoder(hipxel_PipelineWorker *w) {
+	FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
+	if (NULL == decoder)
+		return NULL;
+
+	FLAC__stream_decoder_set_md5_checking(decoder, false);
+	FLAC__stream_decoder_set_metadata_ignore_all(decoder);
+
+	FLAC__StreamDecoderInitStatus initStatus = FLAC__stream_decoder_init_stream(
+			decoder,
+			readCallback, NULL, NULL, NULL, eofCallback, writeCallback,
+			NULL, errorCallback,
+			(void *) w);
+
+	w->input = w->pipeline->streamInfo;
+	w->inputLength = sizeof(w->pipeline->streamInfo);
+	w->inputPosition = 0;
+
+	if (initStatus != FLAC__STREAM_DECODER_INIT_STATUS_OK
+			|| !FLAC__stream_decoder_process_until_end_of_metadata(decoder)) {
+		HIPXEL_LOG_ERROR("worker decoder init failed");
+		FLAC__stream_decoder_delete(decoder);
+		return NULL;
+	}
+
+	return decoder;
+}
+
+static bool decodeSlot(hipxel_PipelineWorker *w, FLAC__StreamDecoder *decoder,
+                       hipxel_PipelineSlot *slot) {
+	if (!FLAC__stream_decoder_flush(decoder))
+		return false;
+
+	w->input = slot->data;
+	w->inputLength = slot->length;
+	w->inputPosition = 0;
+	w->slot = slot;
+	slot->framesCount = 0;
+
+	return FLAC__stream_decoder_process_single(decoder) && slot->framesCount > 0;
+}
+
+// oldest queued frame first, so frame waited for by reader is decoded soonest
+static hipxel_PipelineSlot *takeQueued(hipxel_FramePipeline *fp) {
+	for (uint32_t i = 0; i < fp->slotsCount; ++i) {
+		hipxel_PipelineSlot *slot = &(fp->slots[(fp->head + i) % fp->slotsCount]);
+		if (slot->state == SLOT_QUEUED)
+			return slot;
+	}
+	return NULL;
+}
+
+static void *workerMain(void *arg) {
+	hipxel_PipelineWorker *w = (hipxel_PipelineWorker *) arg;
+	hipxel_FramePipeline *fp = w->pipeline;
+
+	// owner's context counts atomically, so worker's libFLAC shows in owner's footprint
+	hipxel_MemoryContext *previous = hipxel_MemoryContext_bind(fp->memory);
+
+	FLAC__StreamDecoder *decoder = openDecoder(w);
+
+	pthread_mutex_lock(&(fp->mutex));
+	while (true) {
+		hipxel_PipelineSlot *slot = NULL;
+		while (!fp->stopping && NULL == (slot = takeQueued(fp)))
+			pthread_cond_wait(&(fp->queued), &(fp->mutex));
+
+		if (fp->stopping)
+			break;
+
+		slot->state = SLOT_DECODING;
+		pthread_mutex_unlock(&(fp->mutex));
+
+		bool ok = NULL != decoder && decodeSlot(w, decoder, slot);
+
+		pthread_mutex_lock(&(fp->mutex));
+		slot->state = ok ? SLOT_DONE : SLOT_FAILED;
+		pthread_cond_broadcast(&(fp->done));
+	}
+	pthread_mutex_unlock(&(fp->mutex));
+
+	if (NULL != decoder)
+		FLAC__stream_decoder_delete(decoder);
+
+	hipxel_MemoryContext_bind(previous);
+	return NULL;
+}
+
+/**
+ * Keeps source bytes from offset on in input buffer, at least length of them
+ * unless source ends sooner. Returns number of bytes available from offset, -1 on error.
+ */
+static int64_t ensureInput(hipxel_FramePipeline *fp, int64_t offset, int64_t length) {
+	if (offset < fp->inputOffset || offset > fp->inputOffset + fp->inputLength) {
+		fp->inputOffset = offset;
+		fp->inputLength = 0;
+	} else if (offset > fp->inputOffset) {
+		int64_t drop = offset - fp->inputOffset;
+		memmove(fp->input, fp->input + drop, (size_t) (fp->inputLength - drop));
+		fp->inputLength -= drop;
+		fp->inputOffset = offset;
+	}
+
+	if (fp->inputLength >= length)
+		return fp->inputLength;
+
+	if (length + INPUT_CHUNK > fp->inputCapacity) {
+		int64_t capacity = length + INPUT_CHUNK;
+		uint8_t *input = hipxel_MemoryContext_reallocate(fp->memory, fp->input, (size_t) capacity);
+		if (NULL == input)
+			return -1;
+
+		fp->input = input;
+		fp->inputCapacity = capacity;
+	}
+
+	hipxel_DataReader *reader = fp->scanner->reader;
+	int64_t sourceLength = fp->scanner->sourceLength;
+
+	while (fp->inputLength < length) {
+		int64_t position = fp->inputOffset + fp->inputLength;
+		int64_t toRead = fp->inputCapacity - fp->inputLength;
+		if (toRead > sourceLength - position)
+			toRead = sourceLength - position;
+		if (toRead <= 0)
+			break;
+
+		int64_t got = reader->read(reader->p, position, toRead, fp->input + fp->inputLength);
+		if (got < 0)
+			return -1;
+		if (got == 0)
+			break;
+
+		fp->inputLength += got;
+	}
+
+	return fp->inputLength;
+}
+
+/**
+ * Frame ends where next frame with following sample number starts and CRC-16
+ * of bytes before it checks out, last frame ends with source.
+ */
+static bool measureFrame(hipxel_FramePipeline *fp, const hipxel_FrameHeader *frame,
+                         int64_t *outLength) {
+	hipxel_FrameScanner *fs = fp->scanner;
+	int64_t expected = frame->sampleNumber + frame->blockSize;
+	int64_t maxLength = fs->info.maxFrameSize != 0 ? fs->info.maxFrameSize : MAX_FRAME_LENGTH;
+
+	int64_t pos = frame->headerLength;
+	int64_t want = frame->headerLength + INPUT_CHUNK;
+
+	while (true) {
+		int64_t available = ensureInput(fp, frame->offset, want);
+		if (available < 0)
+			return false;
+
+		const uint8_t *d = fp->input;
+		bool atEnd = frame->offset + available >= fs->sourceLength;
+		int64_t limit = atEnd ? available - 1 : available - HIPXEL_FRAMESCANNER_MAX_HEADER_LENGTH;
+
+		for (; pos < limit; ++pos) {
+			if (d[pos] != 0xFF || (d[pos + 1] & 0xFE) != 0xF8)
+				continue;
+
+			hipxel_FrameHeader next;
+			if (!hipxel_FrameScanner_parseHeader(fs, d + pos, available - pos, &next)
+					|| next.sampleNumber != expected)
+				continue;
+
+			// CRC-16 over frame together with its stored CRC leaves zero
+			if ((FLAC__crc16(d, (unsigned) pos) & 0xFFFF) != 0)
+				continue;
+
+			next.offset = frame->offset + pos;
+			fp->next = next;
+			fp->hasNext = true;
+			*outLength = pos;
+			return true;
+		}
+
+		if (atEnd) {
+			fp->hasNext = false;
+			*outLength = available;
+			return available > frame->headerLength;
+		}
+
+		if (pos > maxLength) {
+			HIPXEL_LOG_ERROR("no end of frame at %lld", (long long) frame->offset);
+			return false;
+		}
+
+		want = available + INPUT_CHUNK;
+	}
+}
+
+static bool readFrame(hipxel_FramePipeline *fp, hipxel_PipelineSlot *slot) {
+	slot->frame = fp->next;
+
+	int64_t length = 0;
+	if (!measureFrame(fp, &(slot->frame), &length)) {
+		fp->hasNext = false;
+		return false;
+	}
+
+	if (length > slot->capacity) {
+		uint8_t *data = hipxel_MemoryContext_reallocate(fp->memory, slot->data, (size_t) length);
+		if (NULL == data) {
+			fp->hasNext = false;
+			return false;
+		}
+		slot->data = data;
+		slot->capacity = length;
+	}
+
+	memcpy(slot->data, fp->input, (size_t) length);
+	slot->length = length;
+	return true;
+}
+
+// queues frames into free slots, reads happen on calling thread only
+static void fill(hipxel_FramePipeline *fp) {
+	while (fp->hasNext) {
+		hipxel_PipelineSlot *slot = &(fp->slots[fp->tail]);
+
+		pthread_mutex_lock(&(fp->mutex));
+		bool isFree = slot->state == SLOT_EMPTY;
+		pthread_mutex_unlock(&(fp->mutex));
+		if (!isFree)
+			return;
+
+		bool ok = readFrame(fp, slot);
+
+		pthread_mutex_lock(&(fp->mutex));
+		slot->state = ok ? SLOT_QUEUED : SLOT_FAILED;
+		fp->tail = (fp->tail + 1) % fp->slotsCount;
+		pthread_cond_signal(&(fp->queued));
+		pthread_mutex_unlock(&(fp->mutex));
+	}
+}
+
+int hipxel_FramePipeline_next(hipxel_FramePipeline *fp, const int32_t *const **outSamples,
+		uint32_t *outFramesCount, int64_t *outSampleNumber) {
+	pthread_mutex_lock(&(fp->mutex));
+	if (fp->delivered) {
+		fp->slots[fp->head].state = SLOT_EMPTY;
+		fp->head = (fp->head + 1) % fp->slotsCount;
+		fp->delivered = false;
+	}
+	pthread_mutex_unlock(&(fp->mutex));
+
+	fill(fp);
+
+	pthread_mutex_lock(&(fp->mutex));
+	hipxel_PipelineSlot *slot = &(fp->slots[fp->head]);
+	while (slot->state == SLOT_QUEUED || slot->state == SLOT_DECODING)
+		pthread_cond_wait(&(fp->done), &(fp->mutex));
+	int state = slot->state;
+	pthread_mutex_unlock(&(fp->mutex));
+
+	if (state == SLOT_EMPTY)
+		return HIPXEL_PIPELINE_END;
+
+	if (state == SLOT_FAILED)
+		return HIPXEL_PIPELINE_ERROR;
+
+	fp->delivered = true;
+	*outSamples = (const int32_t *const *) slot->samples;
+	*outFramesCount = slot->framesCount;
+	*outSampleNumber = slot->frame.sampleNumber;
+	return HIPXEL_PIPELINE_FRAME;
+}
+
+void hipxel_FramePipeline_start(hipxel_FramePipeline *fp, const hipxel_FrameHeader *frame) {
+	pthread_mutex_lock(&(fp->mutex));
+
+	// frames being decoded can't be taken back, wait for them before reusing slots
+	bool decoding = true;
+	while (decoding) {
+		decoding = false;
+		for (uint32_t i = 0; i < fp->slotsCount; ++i) {
+			if (fp->slots[i].state == SLOT_QUEUED)
+				fp->slots[i].state = SLOT_EMPTY;
+			if (fp->slots[i].state == SLOT_DECODING)
+				decoding = true;
+		}
+		if (decoding)
+			pthread_cond_wait(&(fp->done), &(fp->mutex));
+	}
+
+	for (uint32_t i = 0; i < fp->slotsCount; ++i)
+		fp->slots[i].state = SLOT_EMPTY;
+	fp->head = 0;
+	fp->tail = 0;
+	fp->delivered = false;
+
+	pthread_mutex_unlock(&(fp->mutex));
+
+	fp->next = *frame;
+	fp->hasNext = true;
+}
+
+hipxel_FramePipeline *hipxel_FramePipeline_new(hipxel_FrameScanner *scanner,
+		hipxel_MemoryContext *memory, uint32_t workersCount) {
+	if (workersCount == 0 || workersCount > HIPXEL_FRAMEPIPELINE_MAX_WORKERS
+			|| scanner->info.channelsCount > HIPXEL_FRAMEPIPELINE_MAX_CHANNELS
+			|| scanner->info.maxBlockSize == 0 || scanner->sourceLength < 0)
+		return NULL;
+
+	hipxel_FramePipeline *fp = hipxel_MemoryContext_allocate(memory, sizeof(hipxel_FramePipeline));
+	if (NULL == fp)
+		return NULL;
+
+	memset(fp, 0, sizeof(hipxel_FramePipeline));
+	fp->scanner = scanner;
+	fp->memory = memory;
+	packStreamInfo(fp);
+
+	pthread_mutex_init(&(fp->mutex), NULL);
+	pthread_cond_init(&(fp->queued), NULL);
+	pthread_cond_init(&(fp->done), NULL);
+
+	// frame per worker plus two, so reader always has next frame decoding
+	fp->slotsCount = workersCount + 2;
+	fp->slots = hipxel_MemoryContext_allocate(memory,
+			fp->slotsCount * sizeof(hipxel_PipelineSlot));
+	if (NULL == fp->slots) {
+		hipxel_FramePipeline_delete(fp);
+		return NULL;
+	}
+	memset(fp->slots, 0, fp->slotsCount * sizeof(hipxel_PipelineSlot));
+
+	size_t samplesSize = scanner->info.maxBlockSize * sizeof(int32_t);
+	for (uint32_t i = 0; i < fp->slotsCount; ++i) {
+		for (uint32_t c = 0; c < scanner->info.channelsCount; ++c) {
+			fp->slots[i].samples[c] = hipxel_MemoryContext_allocate(memory, samplesSize);
+			if (NULL == fp->slots[i].samples[c]) {
+				hipxel_FramePipeline_delete(fp);
+				return NULL;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < workersCount; ++i) {
+		hipxel_PipelineWorker *w = &(fp->workers[i]);
+		w->pipeline = fp;
+		w->started = pthread_create(&(w->thread), NULL, workerMain, w) == 0;
+		if (w->started)
+			++(fp->workersCount);
+	}
+
+	if (fp->workersCount == 0) {
+		HIPXEL_LOG_ERROR("couldn't start pipeline workers");
+		hipxel_FramePipeline_delete(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+void hipxel_FramePipeline_delete(hipxel_FramePipeline *fp) {
+	pthread_mutex_lock(&(fp->mutex));
+	fp->stopping = true;
+	pthread_cond_broadcast(&(fp->queued));
+	pthread_mutex_unlock(&(fp->mutex));
+
+	for (uint32_t i = 0; i < HIPXEL_FRAMEPIPELINE_MAX_WORKERS; ++i) {
+		if (fp->workers[i].started)
+			pthread_join(fp->workers[i].thread, NULL);
+	}
+
+	if (NULL != fp->slots) {
+		for (uint32_t i = 0; i < fp->slotsCount; ++i) {
+			hipxel_PipelineSlot *slot = &(fp->slots[i]);
+			if (NULL != slot->data)
+				hipxel_MemoryContext_deallocate(slot->data);
+			for (uint32_t c = 0; c < HIPXEL_FRAMEPIPELINE_MAX_CHANNELS; ++c) {
+				if (NULL != slot->samples[c])
+					hipxel_MemoryContext_deallocate(slot->samples[c]);
+			}
+		}
+		hipxel_MemoryContext_deallocate(fp->slots);
+	}
+
+	if (NULL != fp->input)
+		hipxel_MemoryContext_deallocate(fp->input);
+
+	pthread_cond_destroy(&(fp->done));
+	pthread_cond_destroy(&(fp->queued));
+	pthread_mutex_destroy(&(fp->mutex));
+
+	hipxel_MemoryContext_deallocate(fp);
+}
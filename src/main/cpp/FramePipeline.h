@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_FRAMEPIPELINE
+#define HIPXEL_FRAMEPIPELINE
+
+#include "FrameScanner.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HIPXEL_FRAMEPIPELINE_MAX_WORKERS 8
+#define HIPXEL_FRAMEPIPELINE_MAX_CHANNELS 8
+
+#define HIPXEL_PIPELINE_FRAME 0
+#define HIPXEL_PIPELINE_END 1
+#define HIPXEL_PIPELINE_ERROR 2
+
+struct hipxel_MemoryContext;
+struct hipxel_FramePipeline;
+
+typedef struct hipxel_PipelineSlot {
+	int state;
+	hipxel_FrameHeader frame;
+
+	uint8_t *data;
+	int64_t length;
+	int64_t capacity;
+
+	int32_t *samples[HIPXEL_FRAMEPIPELINE_MAX_CHANNELS];
+	uint32_t framesCount;
+} hipxel_PipelineSlot;
+
+typedef struct hipxel_PipelineWorker {
+	struct hipxel_FramePipeline *pipeline;
+	pthread_t thread;
+	bool started;
+
+	// input of worker's libFLAC instance, STREAMINFO first and then one frame at a time
+	const uint8_t *input;
+	int64_t inputLength;
+	int64_t inputPosition;
+	hipxel_PipelineSlot *slot;
+} hipxel_PipelineWorker;
+
+/**
+ * Decodes frames in parallel, each worker owns libFLAC instance fed with STREAMINFO
+ * and then single frames. Frames are found and read on calling thread, which also gets
+ * them back in stream order. At most a few frames per worker are decoded ahead.
+ */
+typedef struct hipxel_FramePipeline {
+	hipxel_FrameScanner *scanner;
+	struct hipxel_MemoryContext *memory;
+
+	uint8_t streamInfo[42];
+
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	bool stopping;
+
+	hipxel_PipelineSlot *slots;
+	uint32_t slotsCount;
+	uint32_t head;
+	uint32_t tail;
+	bool delivered;
+
+	bool hasNext;
+	hipxel_FrameHeader next;
+
+	uint8_t *input;
+	int64_t inputOffset;
+	int64_t inputLength;
+	int64_t inputCapacity;
+
+	hipxel_PipelineWorker workers[HIPXEL_FRAMEPIPELINE_MAX_WORKERS];
+	uint32_t workersCount;
+} hipxel_FramePipeline;
+
+/**
+ * Scanner must have STREAMINFO and source length set, it is used only from calling thread.
+ */
+hipxel_FramePipeline *hipxel_FramePipeline_new(hipxel_FrameScanner *scanner,
+		struct hipxel_MemoryContext *memory, uint32_t workersCount);
+
+void hipxel_FramePipeline_delete(hipxel_FramePipeline *fp);
+
+/**
+ * Drops frames decoded ahead and continues from given frame.
+ */
+void hipxel_FramePipeline_start(hipxel_FramePipeline *fp, const hipxel_FrameHeader *frame);
+
+/**
+ * Waits for next frame in stream order, its planar samples stay valid until next call.
+ */
+int hipxel_FramePipeline_next(hipxel_FramePipeline *fp, const int32_t *const **outSamples,
+		uint32_t *outFramesCount, int64_t *outSampleNumber);
+
+#endif // HIPXEL_FRAMEPIPELINE
@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrameScanner.h"
+
+#include "Allocator.h"
+
+#include <private/crc.h>
+
+#include <string.h>
+
+#define WINDOW_SIZE (32 * 1024)
+#define LINEAR_SCAN_RANGE (64 * 1024)
+#define BACKWARD_SCAN_RANGE (4 * 1024)
+#define MAX_HEADER_LENGTH HIPXEL_FRAMESCANNER_MAX_HEADER_LENGTH
+
+static const uint32_t SAMPLE_RATES[12] = {
+		0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000};
+
+static const uint32_t BITS_PER_SAMPLE[8] = {0, 8, 12, 0, 16, 20, 24, 0};
+
+void hipxel_FrameScanner_init(hipxel_FrameScanner *fs, hipxel_DataReader *reader,
+		struct hipxel_MemoryContext *memory) {
+	fs->reader = reader;
+	fs->memory = memory;
+
+	fs->sourceLength = -1;
+	fs->firstFrameOffset = 0;
+	memset(&(fs->info), 0, sizeof(fs->info));
+
+	fs->seekPoints = NULL;
+	fs->seekPointsCount = 0;
+
+	fs->window = NULL;
+	fs->windowOffset = 0;
+	fs->windowLength = 0;
+	fs->windowCapacity = 0;
+	fs->bytesRead = 0;
+}
+
+void hipxel_FrameScanner_release(hipxel_FrameScanner *fs) {
+	hipxel_MemoryContext_deallocate(fs->seekPoints);
+	fs->seekPoints = NULL;
+	fs->seekPointsCount = 0;
+
+	hipxel_MemoryContext_deallocate(fs->window);
+	fs->window = NULL;
+	fs->windowLength = 0;
+	fs->windowCapacity = 0;
+}
+
+static bool loadWindow(hipxel_FrameScanner *fs, int64_t offset, int64_t length) {
+	if (length > fs->windowCapacity) {
+		uint8_t *window = hipxel_MemoryContext_reallocate(fs->memory, fs->window, (size_t) length);
+		if (NULL == window)
+			return false;
+		fs->window = window;
+		fs->windowCapacity = length;
+	}
+
+	hipxel_DataReader *reader = fs->reader;
+	int64_t got = 0;
+	while (got < length) {
+		int64_t r = reader->read(reader->p, offset + got, length - got, fs->window + got);
+		if (r <= 0)
+			break;
+		got += r;
+	}
+
+	fs->windowOffset = offset;
+	fs->windowLength = got;
+	fs->bytesRead += got;
+	return true;
+}
+
+static bool windowCovers(hipxel_FrameScanner *fs, int64_t offset, int64_t end) {
+	int64_t windowEnd = fs->windowOffset + fs->windowLength;
+	bool atSourceEnd = fs->sourceLength >= 0 && windowEnd >= fs->sourceLength;
+	return offset >= fs->windowOffset && offset < windowEnd
+			&& (end <= windowEnd || atSourceEnd);
+}
+
+// returns bytes from offset up to the end of window, at least minLength unless source ends
+static const uint8_t *readAt(hipxel_FrameScanner *fs, int64_t offset, int64_t minLength,
+                             int64_t *outAvailable) {
+	if (!windowCovers(fs, offset, offset + minLength)) {
+		int64_t length = minLength > WINDOW_SIZE ? minLength : WINDOW_SIZE;
+		if (!loadWindow(fs, offset, length))
+			return NULL;
+	}
+
+	*outAvailable = fs->windowOffset + fs->windowLength - offset;
+	if (*outAvailable <= 0)
+		return NULL;
+	return fs->window + (offset - fs->windowOffset);
+}
+
+bool hipxel_FrameScanner_parseHeader(hipxel_FrameScanner *fs, const uint8_t *data,
+		int64_t length, hipxel_FrameHeader *out) {
+	if (length < 6 || data[0] != 0xFF || (data[1] & 0xFE) != 0xF8)
+		return false;
+
+	bool variableBlockSize = (data[1] & 1) != 0;
+	uint32_t blockSizeCode = data[2] >> 4;
+	uint32_t sampleRateCode = data[2] & 0x0F;
+	uint32_t channelsCode = data[3] >> 4;
+	uint32_t bitsCode = (data[3] >> 1) & 0x07;
+
+	if (blockSizeCode == 0 || sampleRateCode == 15 || channelsCode > 10
+			|| (BITS_PER_SAMPLE[bitsCode] == 0 && bitsCode != 0) || (data[3] & 1) != 0)
+		return false;
+
+	// frame or sample number, UTF-8 like coded
+	int64_t pos = 4;
+	uint8_t b = data[pos++];
+	uint64_t number;
+	uint32_t extraBytes;
+	if (!(b & 0x80)) {
+		number = b;
+		extraBytes = 0;
+	} else if ((b & 0xE0) == 0xC0) {
+		number = b & 0x1F;
+		extraBytes = 1;
+	} else if ((b & 0xF0) == 0xE0) {
+		number = b & 0x0F;
+		extraBytes = 2;
+	} else if ((b & 0xF8) == 0xF0) {
+		number = b & 0x07;
+		extraBytes = 3;
+	} else if ((b & 0xFC) == 0xF8) {
+		number = b & 0x03;
+		extraBytes = 4;
+	} else if ((b & 0xFE) == 0xFC) {
+		number = b & 0x01;
+		extraBytes = 5;
+	} else if (b == 0xFE && variableBlockSize) {
+		number = 0;
+		extraBytes = 6;
+	} else {
+		return false;
+	}
+
+	if (pos + extraBytes + 3 > length)
+		return false;
+
+	for (uint32_t i = 0; i < extraBytes; ++i) {
+		b = data[pos++];
+		if ((b & 0xC0) != 0x80)
+			return false;
+		number = (number << 6) | (b & 0x3F);
+	}
+
+	uint32_t blockSize;
+	if (blockSizeCode == 1) {
+		blockSize = 192;
+	} else if (blockSizeCode <= 5) {
+		blockSize = 576u << (blockSizeCode - 2);
+	} else if (blockSizeCode == 6) {
+		blockSize = data[pos++] + 1u;
+	} else if (blockSizeCode == 7) {
+		blockSize = ((uint32_t) data[pos] << 8 | data[pos + 1]) + 1u;
+		pos += 2;
+	} else {
+		blockSize = 256u << (blockSizeCode - 8);
+	}
+
+	uint32_t sampleRate;
+	if (sampleRateCode < 12) {
+		sampleRate = SAMPLE_RATES[sampleRateCode];
+	} else if (sampleRateCode == 12) {
+		sampleRate = data[pos++] * 1000u;
+	} else {
+		if (pos + 2 > length)
+			return false;
+		sampleRate = (uint32_t) data[pos] << 8 | data[pos + 1];
+		if (sampleRateCode == 14)
+			sampleRate *= 10;
+		pos += 2;
+	}
+
+	if (pos >= length || FLAC__crc8(data, (unsigned) pos) != data[pos])
+		return false;
+
+	uint32_t channelsCount = channelsCode < 8 ? channelsCode + 1 : 2;
+	uint32_t bitsPerSample = BITS_PER_SAMPLE[bitsCode];
+
+	if (fs->info.channelsCount != 0 && channelsCount != fs->info.channelsCount)
+		return false;
+	if (sampleRate != 0 && fs->info.sampleRate != 0 && sampleRate != fs->info.sampleRate)
+		return false;
+	if (bitsPerSample != 0 && fs->info.bitsPerSample != 0
+			&& bitsPerSample != fs->info.bitsPerSample)
+		return false;
+	if (fs->info.maxBlockSize != 0 && blockSize > fs->info.maxBlockSize)
+		return false;
+
+	// fixed block size streams number frames, not samples
+	uint32_t fixedBlockSize = fs->info.maxBlockSize != 0 ? fs->info.maxBlockSize : blockSize;
+	uint64_t sampleNumber = variableBlockSize ? number : number * fixedBlockSize;
+
+	if (fs->info.totalSamplesCount != 0 && sampleNumber >= fs->info.totalSamplesCount)
+		return false;
+
+	out->sampleNumber = (int64_t) sampleNumber;
+	out->blockSize = blockSize;
+	out->headerLength = (uint32_t) pos + 1;
+	out->variableBlockSize = variableBlockSize;
+	return true;
+}
+
+bool hipxel_FrameScanner_findNext(hipxel_FrameScanner *fs, int64_t from, int64_t to,
+		hipxel_FrameHeader *out) {
+	int64_t offset = from;
+
+	while (offset < to) {
+		int64_t available = 0;
+		const uint8_t *d = readAt(fs, offset, 2 * MAX_HEADER_LENGTH, &available);
+		if (NULL == d || available < 2)
+			return false;
+
+		// keep whole header of last candidate inside window unless source ends there
+		bool last = available <= 2 * MAX_HEADER_LENGTH;
+		int64_t scanLength = last ? available - 1 : available - MAX_HEADER_LENGTH;
+		if (offset + scanLength > to)
+			scanLength = to - offset;
+
+		for (int64_t i = 0; i < scanLength; ++i) {
+			if (d[i] != 0xFF || (d[i + 1] & 0xFE) != 0xF8)
+				continue;
+
+			if (hipxel_FrameScanner_parseHeader(fs, d + i, available - i, out)) {
+				out->offset = offset + i;
+				return true;
+			}
+		}
+
+		if (last)
+			return false;
+		offset += scanLength;
+	}
+
+	return false;
+}
+
+// frame containing sample starts in [lo, hi), sample bounds are used for interpolation
+static bool locateIn(hipxel_FrameScanner *fs, int64_t sample, int64_t lo, int64_t hi,
+                     int64_t loSample, int64_t hiSample, hipxel_FrameHeader *out) {
+	hipxel_FrameHeader f;
+	bool bisect = hiSample <= loSample;
+
+	while (hi - lo > LINEAR_SCAN_RANGE) {
+		int64_t range = hi - lo;
+		int64_t mid = lo + range / 2;
+		if (!bisect) {
+			// aim one block early, so first frame after estimate is the containing one
+			int64_t target = sample - (int64_t) fs->info.maxBlockSize;
+			double fraction = (double) (target - loSample) / (double) (hiSample - loSample);
+			mid = lo + (int64_t) (fraction * (double) range);
+			if (mid < lo)
+				mid = lo;
+			if (mid >= hi)
+				mid = hi - 1;
+		}
+
+		if (!hipxel_FrameScanner_findNext(fs, mid, hi, &f)) {
+			hi = mid;
+		} else if (f.sampleNumber > sample) {
+			hi = mid;
+			hiSample = f.sampleNumber;
+		} else if (sample < f.sampleNumber + f.blockSize) {
+			*out = f;
+			return true;
+		} else {
+			lo = f.offset + 1;
+			loSample = f.sampleNumber + f.blockSize;
+		}
+
+		// interpolation lands close for roughly constant bitrate, if it didn't
+		// halve the range, fall back to bisection for one step
+		bisect = hiSample <= loSample || (!bisect && hi - lo > range / 2);
+	}
+
+	int64_t from = lo;
+	while (hipxel_FrameScanner_findNext(fs, from, hi, &f)) {
+		if (f.sampleNumber <= sample && sample < f.sampleNumber + f.blockSize) {
+			*out = f;
+			return true;
+		}
+		from = f.offset + 1;
+	}
+
+	return false;
+}
+
+bool hipxel_FrameScanner_locate(hipxel_FrameScanner *fs, int64_t sample,
+		hipxel_FrameHeader *out) {
+	if (fs->sourceLength < 0 || sample < 0)
+		return false;
+
+	if (fs->info.totalSamplesCount != 0 && (uint64_t) sample >= fs->info.totalSamplesCount)
+		return false;
+
+	int64_t lo = fs->firstFrameOffset;
+	int64_t hi = fs->sourceLength;
+	int64_t loSample = 0;
+	int64_t hiSample = (int64_t) fs->info.totalSamplesCount;
+
+	// seek points bracketing sample narrow the range, points are sorted by sample
+	bool narrowed = false;
+	for (uint32_t i = 0; i < fs->seekPointsCount; ++i) {
+		const hipxel_SeekPoint *point = &(fs->seekPoints[i]);
+		int64_t offset = fs->firstFrameOffset + point->offset;
+		if (offset < lo || offset >= hi)
+			continue;
+
+		if (point->sampleNumber <= sample) {
+			lo = offset;
+			loSample = point->sampleNumber;
+		} else {
+			hi = offset;
+			hiSample = point->sampleNumber;
+			narrowed = true;
+			break;
+		}
+		narrowed = true;
+	}
+
+	if (locateIn(fs, sample, lo, hi, loSample, hiSample, out))
+		return true;
+
+	// seek table may be stale or broken
+	return narrowed && locateIn(fs, sample, fs->firstFrameOffset, fs->sourceLength,
+			0, (int64_t) fs->info.totalSamplesCount, out);
+}
+
+bool hipxel_FrameScanner_setSeekPoints(hipxel_FrameScanner *fs,
+		const hipxel_SeekPoint *points, uint32_t count) {
+	hipxel_MemoryContext_deallocate(fs->seekPoints);
+	fs->seekPoints = NULL;
+	fs->seekPointsCount = 0;
+
+	if (count == 0)
+		return true;
+
+	fs->seekPoints = hipxel_MemoryContext_allocate(fs->memory, count * sizeof(hipxel_SeekPoint));
+	if (NULL == fs->seekPoints)
+		return false;
+
+	memcpy(fs->seekPoints, points, count * sizeof(hipxel_SeekPoint));
+	fs->seekPointsCount = count;
+	return true;
+}
+
+bool hipxel_FrameScanner_findPrevious(hipxel_FrameScanner *fs, const hipxel_FrameHeader *frame,
+		hipxel_FrameHeader *out) {
+	if (frame->sampleNumber <= 0)
+		return false;
+
+	int64_t span = fs->info.maxFrameSize != 0
+			? fs->info.maxFrameSize + MAX_HEADER_LENGTH : BACKWARD_SCAN_RANGE;
+
+	while (true) {
+		int64_t from = frame->offset - span;
+		if (from < fs->firstFrameOffset)
+			from = fs->firstFrameOffset;
+
+		// load window ending at this frame with room for earlier ones,
+		// so walking backwards reads every byte about once
+		int64_t end = frame->offset + 2 * MAX_HEADER_LENGTH;
+		if (!windowCovers(fs, from, end)) {
+			int64_t start = from - WINDOW_SIZE;
+			if (start < fs->firstFrameOffset)
+				start = fs->firstFrameOffset;
+			if (!loadWindow(fs, start, end - start))
+				return false;
+		}
+
+		bool found = false;
+		hipxel_FrameHeader f;
+		int64_t pos = from;
+		while (hipxel_FrameScanner_findNext(fs, pos, frame->offset, &f)) {
+			if (f.sampleNumber + f.blockSize == frame->sampleNumber) {
+				*out = f;
+				found = true;
+			}
+			pos = f.offset + 1;
+		}
+
+		if (found)
+			return true;
+
+		if (from <= fs->firstFrameOffset)
+			return false;
+		span *= 2;
+	}
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_FRAMESCANNER
+#define HIPXEL_FRAMESCANNER
+
+#include "DataReader.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HIPXEL_FRAMESCANNER_MAX_HEADER_LENGTH 16
+
+struct hipxel_MemoryContext;
+
+typedef struct hipxel_FrameHeader {
+	int64_t offset;
+	int64_t sampleNumber;
+	uint32_t blockSize;
+	uint32_t headerLength;
+	bool variableBlockSize;
+} hipxel_FrameHeader;
+
+/**
+ * Sample number of frame starting at offset relative to first frame, as in SEEKTABLE.
+ */
+typedef struct hipxel_SeekPoint {
+	int64_t sampleNumber;
+	int64_t offset;
+} hipxel_SeekPoint;
+
+/**
+ * Finds FLAC frames by their headers only, without decoding them.
+ * Candidates are checked with header CRC-8 and against STREAMINFO.
+ */
+typedef struct hipxel_FrameScanner {
+	hipxel_DataReader *reader;
+	struct hipxel_MemoryContext *memory;
+
+	int64_t sourceLength;
+	int64_t firstFrameOffset;
+
+	struct {
+		uint64_t totalSamplesCount;
+		uint32_t minBlockSize;
+		uint32_t maxBlockSize;
+		uint32_t maxFrameSize;
+		uint32_t sampleRate;
+		uint32_t channelsCount;
+		uint32_t bitsPerSample;
+	} info;
+
+	hipxel_SeekPoint *seekPoints;
+	uint32_t seekPointsCount;
+
+	uint8_t *window;
+	int64_t windowOffset;
+	int64_t windowLength;
+	int64_t windowCapacity;
+	int64_t bytesRead;
+} hipxel_FrameScanner;
+
+void hipxel_FrameScanner_init(hipxel_FrameScanner *fs, hipxel_DataReader *reader,
+		struct hipxel_MemoryContext *memory);
+
+void hipxel_FrameScanner_release(hipxel_FrameScanner *fs);
+
+/**
+ * Parses frame header from bytes, length must be at least HIPXEL_FRAMESCANNER_MAX_HEADER_LENGTH
+ * unless data ends there.
+ */
+bool hipxel_FrameScanner_parseHeader(hipxel_FrameScanner *fs, const uint8_t *data,
+		int64_t length, hipxel_FrameHeader *out);
+
+/**
+ * First frame starting in [from, to).
+ */
+bool hipxel_FrameScanner_findNext(hipxel_FrameScanner *fs, int64_t from, int64_t to,
+		hipxel_FrameHeader *out);
+
+/**
+ * Copies seek points sorted by sample number, used to narrow down locate.
+ */
+bool hipxel_FrameScanner_setSeekPoints(hipxel_FrameScanner *fs,
+		const hipxel_SeekPoint *points, uint32_t count);
+
+/**
+ * Frame containing given sample, found by interpolation search over byte offsets
+ * between nearest seek points.
+ */
+bool hipxel_FrameScanner_locate(hipxel_FrameScanner *fs, int64_t sample,
+		hipxel_FrameHeader *out);
+
+/**
+ * Frame ending where given one starts.
+ */
+bool hipxel_FrameScanner_findPrevious(hipxel_FrameScanner *fs, const hipxel_FrameHeader *frame,
+		hipxel_FrameHeader *out);
+
+#endif // HIPXEL_FRAMESCANNER
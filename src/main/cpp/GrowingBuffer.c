@@ -16,12 +16,18 @@
 
 #include "GrowingBuffer.h"
 
+#include "Allocator.h"
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
-hipxel_GrowingBuffer *hipxel_GrowingBuffer_new() {
-	hipxel_GrowingBuffer *gb = malloc(sizeof(hipxel_GrowingBuffer));
+hipxel_GrowingBuffer *hipxel_GrowingBuffer_new(hipxel_MemoryContext *memory) {
+	hipxel_GrowingBuffer *gb = hipxel_MemoryContext_allocate(memory, sizeof(hipxel_GrowingBuffer));
+	if (NULL == gb)
+		return NULL;
+
+	gb->memory = memory;
 	gb->data = NULL;
 	gb->dataCapacity = 0;
 	gb->dataLength = 0;
@@ -30,15 +36,15 @@ hipxel_GrowingBuffer *hipxel_GrowingBuffer_new() {
 }
 
 void hipxel_GrowingBuffer_delete(hipxel_GrowingBuffer *gb) {
-	free(gb->data);
-	free(gb);
+	hipxel_MemoryContext_deallocate(gb->data);
+	hipxel_MemoryContext_deallocate(gb);
 }
 
 static bool ensureCanFit(hipxel_GrowingBuffer *gb, int64_t length) {
 	if (length <= gb->dataCapacity)
 		return true;
 
-	void *newData = realloc(gb->data, length);
+	void *newData = hipxel_MemoryContext_reallocate(gb->memory, gb->data, (size_t) length);
 	if (NULL == newData)
 		return false;
 
@@ -89,6 +95,29 @@ void hipxel_GrowingBuffer_clear(hipxel_GrowingBuffer *gb) {
 	gb->dataLength = 0;
 }
 
+void hipxel_GrowingBuffer_fitCapacity(hipxel_GrowingBuffer *gb, int64_t capacity) {
+	if (capacity < gb->dataLength)
+		capacity = gb->dataLength;
+
+	if (capacity == gb->dataCapacity || capacity <= 0)
+		return;
+
+	void *newData = hipxel_MemoryContext_reallocate(gb->memory, gb->data, (size_t) capacity);
+	if (NULL == newData)
+		return;
+
+	gb->data = (uint8_t *) newData;
+	gb->dataCapacity = capacity;
+}
+
 int64_t hipxel_GrowingBuffer_getLength(hipxel_GrowingBuffer *gb) {
 	return gb->dataLength;
 }
+
+int64_t hipxel_GrowingBuffer_getCapacity(hipxel_GrowingBuffer *gb) {
+	return gb->dataCapacity;
+}
+
+void *hipxel_GrowingBuffer_getData(hipxel_GrowingBuffer *gb) {
+	return gb->data;
+}
@@ -20,13 +20,16 @@
 #include <stdint.h>
 #include <jni.h>
 
+struct hipxel_MemoryContext;
+
 typedef struct hipxel_GrowingBuffer {
+	struct hipxel_MemoryContext *memory;
 	uint8_t *data;
 	int64_t dataCapacity;
 	int64_t dataLength;
 } hipxel_GrowingBuffer;
 
-hipxel_GrowingBuffer *hipxel_GrowingBuffer_new();
+hipxel_GrowingBuffer *hipxel_GrowingBuffer_new(struct hipxel_MemoryContext *memory);
 
 void hipxel_GrowingBuffer_delete(hipxel_GrowingBuffer *gb);
 
@@ -39,6 +42,15 @@ int64_t hipxel_GrowingBuffer_discard(hipxel_GrowingBuffer *gb, int64_t length);
 
 void hipxel_GrowingBuffer_clear(hipxel_GrowingBuffer *gb);
 
+/**
+ * Grows or shrinks capacity to given one, but never below current length.
+ */
+void hipxel_GrowingBuffer_fitCapacity(hipxel_GrowingBuffer *gb, int64_t capacity);
+
 int64_t hipxel_GrowingBuffer_getLength(hipxel_GrowingBuffer *gb);
 
+int64_t hipxel_GrowingBuffer_getCapacity(hipxel_GrowingBuffer *gb);
+
+void *hipxel_GrowingBuffer_getData(hipxel_GrowingBuffer *gb);
+
 #endif // HIPXEL_GROWINGBUFFER
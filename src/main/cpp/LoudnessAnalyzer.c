@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LoudnessAnalyzer.h"
+
+#include "Allocator.h"
+
+#include <math.h>
+#include <string.h>
+
+#define REPLAYGAIN_REFERENCE_LUFS (-18.0)
+#define ABSOLUTE_GATE_LUFS (-70.0)
+#define HISTOGRAM_MAX_LUFS 5.0
+#define BIN_WIDTH_LU 0.1
+#define MOMENTARY_BLOCKS 4
+
+typedef int64_t hipxel_v2l __attribute__((vector_size(16)));
+
+static inline hipxel_v2d splat(double v) {
+	hipxel_v2d r = {v, v};
+	return r;
+}
+
+static inline hipxel_v2d vmax(hipxel_v2d a, hipxel_v2d b) {
+	hipxel_v2l m = a > b;
+	return (hipxel_v2d) (((hipxel_v2l) a & m) | ((hipxel_v2l) b & ~m));
+}
+
+static inline double energyToLufs(double energy) {
+	return -0.691 + 10.0 * log10(energy);
+}
+
+// BS.1770 K-weighting as in libebur128: high shelf followed by high pass
+static void computeFilters(hipxel_LoudnessAnalyzer *la) {
+	double rate = (double) la->sampleRate;
+
+	double f0 = 1681.974450955533;
+	double gainDb = 3.999843853973347;
+	double q = 0.7071752369554196;
+	double k = tan(M_PI * f0 / rate);
+	double vh = pow(10.0, gainDb / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	la->shelf[0] = (vh + vb * k / q + k * k) / a0;
+	la->shelf[1] = 2.0 * (k * k - vh) / a0;
+	la->shelf[2] = (vh - vb * k / q + k * k) / a0;
+	la->shelf[3] = 2.0 * (k * k - 1.0) / a0;
+	la->shelf[4] = (1.0 - k / q + k * k) / a0;
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+
+	la->highPass[0] = 1.0;
+	la->highPass[1] = -2.0;
+	la->highPass[2] = 1.0;
+	la->highPass[3] = 2.0 * (k * k - 1.0) / a0;
+	la->highPass[4] = (1.0 - k / q + k * k) / a0;
+}
+
+// 4x polyphase interpolator, phase 0 reproduces input sample
+static void computeTaps(hipxel_LoudnessAnalyzer *la) {
+	for (uint32_t phase = 0; phase < 4; ++phase) {
+		double sum = 0.0;
+		for (uint32_t j = 0; j < 12; ++j) {
+			double t = 6.0 - j - phase / 4.0;
+			double sinc = t == 0.0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+			double window = 0.5 + 0.5 * cos(M_PI * t / 6.5);
+			la->taps[phase][j] = sinc * window;
+			sum += la->taps[phase][j];
+		}
+		for (uint32_t j = 0; j < 12; ++j)
+			la->taps[phase][j] /= sum;
+	}
+}
+
+// BS.1770 weights for FLAC channel orders, surround channels get +1.5 dB, LFE is skipped
+static void computeWeights(hipxel_LoudnessAnalyzer *la) {
+	static const double SURROUND = 1.41;
+	uint32_t n = la->channelsCount;
+
+	for (uint32_t c = 0; c < HIPXEL_LOUDNESS_MAX_CHANNELS; ++c)
+		la->weights[c] = c < n ? 1.0 : 0.0;
+
+	if (n == 4) {
+		la->weights[2] = SURROUND;
+		la->weights[3] = SURROUND;
+	} else if (n == 5) {
+		la->weights[3] = SURROUND;
+		la->weights[4] = SURROUND;
+	} else if (n >= 6) {
+		la->weights[3] = 0.0;
+		for (uint32_t c = 4; c < n; ++c)
+			la->weights[c] = SURROUND;
+	}
+}
+
+void hipxel_LoudnessAnalyzer_reset(hipxel_LoudnessAnalyzer *la) {
+	memset(la->filterState, 0, sizeof(la->filterState));
+	memset(la->energy, 0, sizeof(la->energy));
+
+	la->subBlockFill = 0;
+	la->subBlocksCount = 0;
+	memset(la->subBlocks, 0, sizeof(la->subBlocks));
+
+	memset(&(la->momentary), 0, sizeof(la->momentary));
+	memset(&(la->shortTerm), 0, sizeof(la->shortTerm));
+
+	la->historyPosition = 0;
+	memset(la->history, 0, sizeof(la->history));
+	memset(la->samplePeak, 0, sizeof(la->samplePeak));
+	memset(la->truePeak, 0, sizeof(la->truePeak));
+}
+
+hipxel_LoudnessAnalyzer *hipxel_LoudnessAnalyzer_new(struct hipxel_MemoryContext *memory,
+		uint32_t sampleRate, uint32_t channelsCount, uint32_t bitsPerSample) {
+	if (sampleRate == 0 || channelsCount == 0 || channelsCount > HIPXEL_LOUDNESS_MAX_CHANNELS)
+		return NULL;
+
+	hipxel_LoudnessAnalyzer *la = hipxel_MemoryContext_allocate(memory,
+			sizeof(hipxel_LoudnessAnalyzer));
+	if (NULL == la)
+		return NULL;
+
+	la->memory = memory;
+	la->sampleRate = sampleRate;
+	la->channelsCount = channelsCount;
+	la->pairsCount = (channelsCount + 1) / 2;
+	la->scale = 1.0 / (double) (1ull << (bitsPerSample - 1));
+	la->subBlockLength = sampleRate / 10;
+	la->oversampling = sampleRate < 96000;
+
+	computeFilters(la);
+	computeTaps(la);
+	computeWeights(la);
+	hipxel_LoudnessAnalyzer_reset(la);
+
+	return la;
+}
+
+void hipxel_LoudnessAnalyzer_delete(hipxel_LoudnessAnalyzer *la) {
+	hipxel_MemoryContext_deallocate(la);
+}
+
+static void addToHistogram(hipxel_LoudnessHistogram *h, double energy) {
+	double lufs = energyToLufs(energy);
+	if (!(lufs >= ABSOLUTE_GATE_LUFS))
+		return;
+
+	int bin = (int) ((lufs - ABSOLUTE_GATE_LUFS) / BIN_WIDTH_LU);
+	if (bin >= HIPXEL_LOUDNESS_BINS)
+		bin = HIPXEL_LOUDNESS_BINS - 1;
+
+	++(h->counts[bin]);
+	h->energies[bin] += energy;
+}
+
+static void finishSubBlock(hipxel_LoudnessAnalyzer *la) {
+	double sum = 0.0;
+	for (uint32_t p = 0; p < la->pairsCount; ++p) {
+		sum += la->weights[2 * p] * la->energy[p][0] + la->weights[2 * p + 1] * la->energy[p][1];
+		la->energy[p] = splat(0.0);
+	}
+
+	la->subBlocks[la->subBlocksCount % HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS] = sum / la->subBlockLength;
+	++(la->subBlocksCount);
+	la->subBlockFill = 0;
+
+	// 400 ms gating blocks and 3 s short-term blocks, both stepping by 100 ms
+	if (la->subBlocksCount >= MOMENTARY_BLOCKS) {
+		double e = 0.0;
+		for (uint32_t i = 1; i <= MOMENTARY_BLOCKS; ++i)
+			e += la->subBlocks[(la->subBlocksCount - i) % HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS];
+		addToHistogram(&(la->momentary), e / MOMENTARY_BLOCKS);
+	}
+
+	if (la->subBlocksCount >= HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS) {
+		double e = 0.0;
+		for (uint32_t i = 0; i < HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS; ++i)
+			e += la->subBlocks[i];
+		addToHistogram(&(la->shortTerm), e / HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS);
+	}
+}
+
+static void processPair(hipxel_LoudnessAnalyzer *la, uint32_t p,
+                        const int32_t *left, const int32_t *right, uint32_t framesCount) {
+	hipxel_v2d scale = splat(la->scale);
+	hipxel_v2d sb0 = splat(la->shelf[0]), sb1 = splat(la->shelf[1]), sb2 = splat(la->shelf[2]);
+	hipxel_v2d sa1 = splat(la->shelf[3]), sa2 = splat(la->shelf[4]);
+	hipxel_v2d ha1 = splat(la->highPass[3]), ha2 = splat(la->highPass[4]);
+
+	hipxel_v2d z1 = la->filterState[p][0], z2 = la->filterState[p][1];
+	hipxel_v2d w1 = la->filterState[p][2], w2 = la->filterState[p][3];
+	hipxel_v2d energy = la->energy[p];
+	hipxel_v2d samplePeak = la->samplePeak[p];
+	hipxel_v2d truePeak = la->truePeak[p];
+	hipxel_v2d *history = la->history[p];
+	uint32_t position = la->historyPosition;
+
+	for (uint32_t i = 0; i < framesCount; ++i) {
+		hipxel_v2d x = {(double) left[i], (double) right[i]};
+		x *= scale;
+
+		samplePeak = vmax(samplePeak, x * x);
+
+		// transposed direct form II, high pass numerator is 1, -2, 1
+		hipxel_v2d y = sb0 * x + z1;
+		z1 = sb1 * x - sa1 * y + z2;
+		z2 = sb2 * x - sa2 * y;
+
+		hipxel_v2d k = y + w1;
+		w1 = -2.0 * y - ha1 * k + w2;
+		w2 = y - ha2 * k;
+
+		energy += k * k;
+
+		if (la->oversampling) {
+			// history is mirrored, so last 12 samples are contiguous
+			position = position == 0 ? 11 : position - 1;
+			history[position] = x;
+			history[position + 12] = x;
+
+			for (uint32_t phase = 1; phase < 4; ++phase) {
+				const double *taps = la->taps[phase];
+				hipxel_v2d acc = splat(0.0);
+				for (uint32_t j = 0; j < 12; ++j)
+					acc += splat(taps[j]) * history[position + j];
+				truePeak = vmax(truePeak, acc * acc);
+			}
+		}
+	}
+
+	la->filterState[p][0] = z1;
+	la->filterState[p][1] = z2;
+	la->filterState[p][2] = w1;
+	la->filterState[p][3] = w2;
+	la->energy[p] = energy;
+	la->samplePeak[p] = samplePeak;
+	la->truePeak[p] = vmax(truePeak, samplePeak);
+}
+
+void hipxel_LoudnessAnalyzer_process(hipxel_LoudnessAnalyzer *la,
+		const int32_t *const buffer[], uint32_t framesCount) {
+	uint32_t done = 0;
+
+	while (done < framesCount) {
+		uint32_t n = la->subBlockLength - la->subBlockFill;
+		if (n > framesCount - done)
+			n = framesCount - done;
+
+		for (uint32_t p = 0; p < la->pairsCount; ++p) {
+			// odd channel goes twice, its copy has zero weight
+			uint32_t right = 2 * p + 1 < la->channelsCount ? 2 * p + 1 : 2 * p;
+			processPair(la, p, buffer[2 * p] + done, buffer[right] + done, n);
+		}
+		la->historyPosition = (uint32_t) ((la->historyPosition + 12 - n % 12) % 12);
+
+		la->subBlockFill += n;
+		done += n;
+
+		if (la->subBlockFill == la->subBlockLength)
+			finishSubBlock(la);
+	}
+}
+
+static void gatedMean(const hipxel_LoudnessHistogram *h, double relativeGateLu,
+                      uint32_t *outFirstBin, uint32_t *outCount, double *outEnergy) {
+	uint64_t count = 0;
+	double energy = 0.0;
+	for (uint32_t b = 0; b < HIPXEL_LOUDNESS_BINS; ++b) {
+		count += h->counts[b];
+		energy += h->energies[b];
+	}
+
+	*outFirstBin = HIPXEL_LOUDNESS_BINS;
+	*outCount = 0;
+	*outEnergy = 0.0;
+	if (count == 0)
+		return;
+
+	double gate = energyToLufs(energy / count) + relativeGateLu;
+	for (uint32_t b = 0; b < HIPXEL_LOUDNESS_BINS; ++b) {
+		double binLufs = ABSOLUTE_GATE_LUFS + (b + 0.5) * BIN_WIDTH_LU;
+		if (binLufs < gate)
+			continue;
+
+		if (*outFirstBin == HIPXEL_LOUDNESS_BINS)
+			*outFirstBin = b;
+		*outCount += h->counts[b];
+		*outEnergy += h->energies[b];
+	}
+}
+
+static double percentileLufs(const hipxel_LoudnessHistogram *h, uint32_t firstBin,
+                             uint32_t count, double fraction) {
+	uint32_t target = (uint32_t) (fraction * (count - 1));
+	uint32_t seen = 0;
+	for (uint32_t b = firstBin; b < HIPXEL_LOUDNESS_BINS; ++b) {
+		seen += h->counts[b];
+		if (seen > target)
+			return ABSOLUTE_GATE_LUFS + (b + 0.5) * BIN_WIDTH_LU;
+	}
+	return HISTOGRAM_MAX_LUFS;
+}
+
+void hipxel_LoudnessAnalyzer_getResult(hipxel_LoudnessAnalyzer *la, hipxel_LoudnessResult *out) {
+	uint32_t firstBin, count;
+	double energy;
+
+	gatedMean(&(la->momentary), -10.0, &firstBin, &count, &energy);
+	out->integratedLufs = count > 0 ? energyToLufs(energy / count) : -HUGE_VAL;
+	out->replayGainDb = count > 0 ? REPLAYGAIN_REFERENCE_LUFS - out->integratedLufs : 0.0;
+
+	gatedMean(&(la->shortTerm), -20.0, &firstBin, &count, &energy);
+	out->loudnessRangeLu = count > 0
+			? percentileLufs(&(la->shortTerm), firstBin, count, 0.95)
+					- percentileLufs(&(la->shortTerm), firstBin, count, 0.10)
+			: 0.0;
+
+	double samplePeak = 0.0, truePeak = 0.0;
+	for (uint32_t p = 0; p < la->pairsCount; ++p) {
+		for (uint32_t lane = 0; lane < 2; ++lane) {
+			if (la->samplePeak[p][lane] > samplePeak)
+				samplePeak = la->samplePeak[p][lane];
+			if (la->truePeak[p][lane] > truePeak)
+				truePeak = la->truePeak[p][lane];
+		}
+	}
+
+	out->samplePeak = sqrt(samplePeak);
+	out->truePeak = sqrt(truePeak);
+}
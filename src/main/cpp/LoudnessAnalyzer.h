@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_LOUDNESSANALYZER
+#define HIPXEL_LOUDNESSANALYZER
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HIPXEL_LOUDNESS_MAX_CHANNELS 8
+#define HIPXEL_LOUDNESS_MAX_PAIRS (HIPXEL_LOUDNESS_MAX_CHANNELS / 2)
+
+// loudness histograms cover -70 to +5 LUFS in 0.1 LU bins
+#define HIPXEL_LOUDNESS_BINS 750
+
+// short-term window in 100 ms sub-blocks
+#define HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS 30
+
+struct hipxel_MemoryContext;
+
+typedef double hipxel_v2d __attribute__((vector_size(16)));
+
+typedef struct hipxel_LoudnessResult {
+	double integratedLufs;
+	double loudnessRangeLu;
+	double samplePeak;
+	double truePeak;
+	double replayGainDb;
+} hipxel_LoudnessResult;
+
+typedef struct hipxel_LoudnessHistogram {
+	uint32_t counts[HIPXEL_LOUDNESS_BINS];
+	double energies[HIPXEL_LOUDNESS_BINS];
+} hipxel_LoudnessHistogram;
+
+/**
+ * EBU R128 / ITU-R BS.1770 meter fed with planar samples straight from libFLAC.
+ * Channels are processed in pairs with vector extensions, so stereo K-weighting
+ * and true peak oversampling run in one lane pair.
+ */
+typedef struct hipxel_LoudnessAnalyzer {
+	struct hipxel_MemoryContext *memory;
+
+	uint32_t sampleRate;
+	uint32_t channelsCount;
+	uint32_t pairsCount;
+	double scale;
+	double weights[HIPXEL_LOUDNESS_MAX_PAIRS * 2];
+
+	double shelf[5];
+	double highPass[5];
+	hipxel_v2d filterState[HIPXEL_LOUDNESS_MAX_PAIRS][4];
+	hipxel_v2d energy[HIPXEL_LOUDNESS_MAX_PAIRS];
+
+	uint32_t subBlockLength;
+	uint32_t subBlockFill;
+	uint64_t subBlocksCount;
+	double subBlocks[HIPXEL_LOUDNESS_SHORT_TERM_BLOCKS];
+
+	hipxel_LoudnessHistogram momentary;
+	hipxel_LoudnessHistogram shortTerm;
+
+	bool oversampling;
+	double taps[4][12];
+	uint32_t historyPosition;
+	hipxel_v2d history[HIPXEL_LOUDNESS_MAX_PAIRS][24];
+	hipxel_v2d samplePeak[HIPXEL_LOUDNESS_MAX_PAIRS];
+	hipxel_v2d truePeak[HIPXEL_LOUDNESS_MAX_PAIRS];
+} hipxel_LoudnessAnalyzer;
+
+hipxel_LoudnessAnalyzer *hipxel_LoudnessAnalyzer_new(struct hipxel_MemoryContext *memory,
+		uint32_t sampleRate, uint32_t channelsCount, uint32_t bitsPerSample);
+
+void hipxel_LoudnessAnalyzer_delete(hipxel_LoudnessAnalyzer *la);
+
+void hipxel_LoudnessAnalyzer_reset(hipxel_LoudnessAnalyzer *la);
+
+void hipxel_LoudnessAnalyzer_process(hipxel_LoudnessAnalyzer *la,
+		const int32_t *const buffer[], uint32_t framesCount);
+
+/**
+ * Integrated loudness is -HUGE_VAL when everything was gated out,
+ * ReplayGain is relative to -18 LUFS reference.
+ */
+void hipxel_LoudnessAnalyzer_getResult(hipxel_LoudnessAnalyzer *la, hipxel_LoudnessResult *out);
+
+#endif // HIPXEL_LOUDNESSANALYZER
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PoolAllocator.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CLASS_SHIFT 5
+#define MAX_CLASS_SHIFT 22
+#define CLASSES_COUNT (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+
+// free blocks kept per class, surplus goes back to malloc
+#define CLASS_CACHE_BYTES (256 * 1024)
+
+// blocks above largest class go straight to malloc and are marked with CLASSES_COUNT
+typedef union {
+	struct {
+		uint32_t sizeClass;
+		size_t size;
+	} info;
+	uint8_t padding[16];
+} hipxel_PoolHeader;
+
+typedef struct hipxel_PoolBlock {
+	struct hipxel_PoolBlock *next;
+} hipxel_PoolBlock;
+
+// each class has its own lock, so decoders and pipeline workers allocating
+// different sizes don't contend
+typedef struct {
+	pthread_mutex_t lock;
+	hipxel_PoolBlock *freeBlocks;
+	uint32_t freeCount;
+} hipxel_PoolClass;
+
+static hipxel_PoolClass classes[CLASSES_COUNT] = {
+	[0 ... CLASSES_COUNT - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+};
+
+static uint32_t classFor(size_t size) {
+	uint32_t c = 0;
+	while (c < CLASSES_COUNT && ((size_t) 1 << (c + MIN_CLASS_SHIFT)) < size)
+		++c;
+	return c;
+}
+
+static size_t classSize(uint32_t sizeClass) {
+	return (size_t) 1 << (sizeClass + MIN_CLASS_SHIFT);
+}
+
+static uint32_t maxFreeCount(uint32_t sizeClass) {
+	size_t count = CLASS_CACHE_BYTES / classSize(sizeClass);
+	return count > 0 ? (uint32_t) count : 1;
+}
+
+static void *pool_allocate(void *p, size_t size) {
+	uint32_t c = classFor(size);
+	hipxel_PoolHeader *h = NULL;
+
+	if (c < CLASSES_COUNT) {
+		hipxel_PoolClass *pc = &(classes[c]);
+		pthread_mutex_lock(&(pc->lock));
+		hipxel_PoolBlock *block = pc->freeBlocks;
+		if (NULL != block) {
+			pc->freeBlocks = block->next;
+			--(pc->freeCount);
+		}
+		pthread_mutex_unlock(&(pc->lock));
+
+		h = (hipxel_PoolHeader *) block;
+		if (NULL == h)
+			h = malloc(sizeof(hipxel_PoolHeader) + classSize(c));
+	} else if (size <= SIZE_MAX - sizeof(hipxel_PoolHeader)) {
+		h = malloc(sizeof(hipxel_PoolHeader) + size);
+	}
+
+	if (NULL == h)
+		return NULL;
+
+	h->info.sizeClass = c;
+	h->info.size = size;
+	return h + 1;
+}
+
+static void pool_deallocate(void *p, void *ptr) {
+	if (NULL == ptr)
+		return;
+
+	hipxel_PoolHeader *h = ((hipxel_PoolHeader *) ptr) - 1;
+	uint32_t c = h->info.sizeClass;
+
+	if (c >= CLASSES_COUNT) {
+		free(h);
+		return;
+	}
+
+	hipxel_PoolBlock *block = (hipxel_PoolBlock *) h;
+	hipxel_PoolClass *pc = &(classes[c]);
+
+	pthread_mutex_lock(&(pc->lock));
+	bool keep = pc->freeCount < maxFreeCount(c);
+	if (keep) {
+		block->next = pc->freeBlocks;
+		pc->freeBlocks = block;
+		++(pc->freeCount);
+	}
+	pthread_mutex_unlock(&(pc->lock));
+
+	if (!keep)
+		free(h);
+}
+
+static void *pool_reallocate(void *p, void *ptr, size_t size) {
+	if (NULL == ptr)
+		return pool_allocate(p, size);
+
+	hipxel_PoolHeader *h = ((hipxel_PoolHeader *) ptr) - 1;
+	uint32_t c = h->info.sizeClass;
+
+	if (c < CLASSES_COUNT && size <= classSize(c)) {
+		h->info.size = size;
+		return ptr;
+	}
+
+	void *n = pool_allocate(p, size);
+	if (NULL == n)
+		return NULL;
+
+	memcpy(n, ptr, h->info.size < size ? h->info.size : size);
+	pool_deallocate(p, ptr);
+	return n;
+}
+
+hipxel_Allocator hipxel_PoolAllocator_shared() {
+	hipxel_Allocator v;
+	v.allocate = pool_allocate;
+	v.reallocate = pool_reallocate;
+	v.deallocate = pool_deallocate;
+	v.p = NULL;
+	return v;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HIPXEL_POOLALLOCATOR
+#define HIPXEL_POOLALLOCATOR
+
+#include "Allocator.h"
+
+/**
+ * Process-wide pool with power of two size classes. Freed blocks are kept for reuse,
+ * so opening and closing decoders doesn't fragment heap, but only up to 256 KiB
+ * (or one block) per class, so pool doesn't hold on to peak working set.
+ */
+hipxel_Allocator hipxel_PoolAllocator_shared();
+
+#endif // HIPXEL_POOLALLOCATOR
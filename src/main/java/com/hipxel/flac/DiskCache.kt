@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.hipxel.flac
+
+/**
+ * Persistent sparse cache of source bytes, so replays and seeks into already fetched
+ * regions don't touch [DataReader]. All entries in [directory] share [budgetBytes],
+ * least recently used data is evicted first. [key] identifies the source, f.e. its url.
+ */
+class DiskCache(val directory: String, val key: String, val budgetBytes: Long)
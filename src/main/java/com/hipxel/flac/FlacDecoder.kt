@@ -17,26 +17,77 @@
 package com.hipxel.flac
 
 import java.nio.ByteBuffer
+import java.nio.ByteOrder
 
-class FlacDecoder(dataReader: DataReader) {
+/**
+ * [lowFootprint] keeps decoded data buffer at two blocks of the stream instead of letting it grow,
+ * [pooledMemory] takes memory from pool shared by all decoders, so open/close churn
+ * doesn't fragment heap.
+ */
+class FlacDecoder private constructor(
+		dataReader: DataReader?,
+		diskCache: DiskCache?,
+		stream: FlacStream?,
+		lowFootprint: Boolean,
+		pooledMemory: Boolean
+) {
 	private var pointer: ByteBuffer? = null
+	private var statusBuffer: ByteBuffer? = null
+
+	@Volatile
+	private var barrier = 0
+
+	constructor(
+			dataReader: DataReader,
+			diskCache: DiskCache? = null,
+			lowFootprint: Boolean = false,
+			pooledMemory: Boolean = false
+	) : this(dataReader, diskCache, null, lowFootprint, pooledMemory)
+
+	internal constructor(stream: FlacStream, lowFootprint: Boolean, pooledMemory: Boolean)
+			: this(null, null, stream, lowFootprint, pooledMemory)
 
 	init {
 		if (!Loader.loadNative())
 			throw IllegalStateException("native library is not loaded")
 
-		pointer = create(dataReader)
+		pointer = if (stream != null) {
+			stream.pointer?.let { createCursor(it, lowFootprint, pooledMemory) }
+		} else {
+			dataReader?.let {
+				create(it, diskCache?.directory, diskCache?.key,
+						diskCache?.budgetBytes ?: 0L, lowFootprint, pooledMemory)
+			}
+		}
 		if (pointer == null)
 			throw IllegalStateException("native create failed")
+
+		statusBuffer = pointer?.let { getStatusBuffer(it).order(ByteOrder.nativeOrder()) }
 	}
 
 	fun release() {
 		pointer?.let {
+			statusBuffer = null
 			pointer = null
 			release(it)
 		}
 	}
 
+	/**
+	 * Hands native decoder over to new owner, this object is unusable afterwards.
+	 */
+	internal fun detach(): ByteBuffer? {
+		val p = pointer
+		statusBuffer = null
+		pointer = null
+		return p
+	}
+
+	internal fun attach(p: ByteBuffer) {
+		pointer = p
+		statusBuffer = getStatusBuffer(p).order(ByteOrder.nativeOrder())
+	}
+
 	fun step(): Boolean {
 		return pointer?.let { step(it) } ?: false
 	}
@@ -45,51 +96,291 @@ class FlacDecoder(dataReader: DataReader) {
 		return pointer?.let { read(it, buffer, length) } ?: -1L
 	}
 
-	fun seekTo(position: Long) {
-		pointer?.let { seekTo(it, position) }
+	/**
+	 * Modes other than [SEEK_EXACT] land on frame boundary near [position] without decoding
+	 * samples before it, [pcmFramesPosition] tells where it landed.
+	 */
+	fun seekTo(position: Long, mode: Int = SEEK_EXACT) {
+		pointer?.let { seekTo(it, position, mode) }
+	}
+
+	/**
+	 * Sets row-major [outputChannelsCount] x [channelsCount] matrix used to select,
+	 * downmix and scale channels while decoding. Null restores all source channels.
+	 */
+	fun setOutputMatrix(outputChannelsCount: Int, matrix: FloatArray?): Boolean {
+		return pointer?.let { setOutputMatrix(it, outputChannelsCount, matrix) } ?: false
+	}
+
+	/**
+	 * [FORMAT_S16], [FORMAT_S32] left aligned or [FORMAT_FLOAT] samples, bytes given by [read]
+	 * are in native order. Scrub mode needs [FORMAT_S16].
+	 */
+	fun setOutputFormat(format: Int): Boolean {
+		return pointer?.let { setOutputFormat(it, format) } ?: false
+	}
+
+	fun setReplayGain(mode: Int, preampDb: Float = 0f) {
+		pointer?.let { setReplayGain(it, mode, preampDb) }
+	}
+
+	/**
+	 * In reverse mode [read] returns frames time-reversed, going back from current position.
+	 * Works only for sources with known size.
+	 */
+	fun setReverse(enabled: Boolean): Boolean {
+		return pointer?.let { setReverse(it, enabled) } ?: false
+	}
+
+	/**
+	 * Decodes frames ahead on [workersCount] threads for streams one core can't decode
+	 * in real time, 0 turns it off. Works only for sources with known size.
+	 */
+	fun setPipeline(workersCount: Int): Boolean {
+		return pointer?.let { setPipeline(it, workersCount) } ?: false
+	}
+
+	/**
+	 * Scrub mode plays short crossfaded grains while skipping [speed] times faster,
+	 * negative speed skips backwards. Grains get longer when more than [maxFramesPerSecond]
+	 * FLAC frames would be decoded or [maxBytesPerSecond] read per second of output,
+	 * 0 means no limit. Zero speed turns scrub mode off. Works only for sources with known size.
+	 */
+	fun setScrub(speed: Float, maxFramesPerSecond: Int = 0, maxBytesPerSecond: Long = 0L): Boolean {
+		return pointer?.let { setScrub(it, speed, maxFramesPerSecond, maxBytesPerSecond) } ?: false
+	}
+
+	/**
+	 * Attaches loudness meter to decoding. With [analyzeOnly] decoded frames only feed
+	 * the meter, [read] gets nothing while position still advances.
+	 */
+	fun setAnalysis(enabled: Boolean, analyzeOnly: Boolean = false): Boolean {
+		return pointer?.let { setAnalysis(it, enabled, analyzeOnly) } ?: false
+	}
+
+	/**
+	 * Loudness of everything decoded since analysis was enabled.
+	 */
+	val loudness: Loudness?
+		get() = pointer?.let { getLoudness(it) }?.let { toLoudness(it) }
+
+	/**
+	 * Measures whole stream in one native call, then rewinds to start. Meter attached
+	 * by [setAnalysis] keeps its [loudness] and mode.
+	 */
+	fun analyze(): Loudness? {
+		return pointer?.let { analyze(it) }?.let { toLoudness(it) }
+	}
+
+	private fun toLoudness(values: DoubleArray): Loudness {
+		return Loudness(values[0], values[1], values[2], values[3], values[4])
+	}
+
+	/**
+	 * [integratedLufs] is negative infinity for silence, [replayGainDb] is relative to -18 LUFS.
+	 */
+	class Loudness(
+			val integratedLufs: Double,
+			val loudnessRangeLu: Double,
+			val samplePeak: Double,
+			val truePeak: Double,
+			val replayGainDb: Double
+	)
+
+	/**
+	 * Snapshot filled by [readStatus], meant to be reused between polls.
+	 */
+	class Status {
+		var pcmFramesPosition = 0L
+		var bytesReadyCount = 0L
+		var endOfFile = true
+		var finished = true
 	}
 
 	val sampleRate: Int
-		get() = pointer?.let { getSampleRate(it) } ?: 0
+		get() = readInt(SAMPLE_RATE)
 
 	val channelsCount: Int
-		get() = pointer?.let { getChannelsCount(it) } ?: 0
+		get() = readInt(CHANNELS_COUNT)
+
+	val outputChannelsCount: Int
+		get() = readInt(OUTPUT_CHANNELS_COUNT)
 
 	val bitsPerSample: Int
-		get() = pointer?.let { getBitsPerSample(it) } ?: 0
+		get() = readInt(BITS_PER_SAMPLE)
 
 	val totalSamplesCount: Long
-		get() = pointer?.let { getTotalSamplesCount(it) } ?: 0
+		get() = readLong(TOTAL_SAMPLES_COUNT)
 
 	val pcmFramesPosition: Long
-		get() = pointer?.let { getPcmFramesPosition(it) } ?: 0
+		get() = readLong(PCM_FRAMES_POSITION)
 
 	val bytesReadyCount: Long
-		get() = pointer?.let { getBytesReadyCount(it) } ?: 0
+		get() = readLong(BYTES_READY_COUNT)
 
-	private external fun create(dataReader: DataReader): ByteBuffer?
+	val endOfFile: Boolean
+		get() = readInt(FLAGS, NO_STATUS_FLAGS) and STATUS_END_OF_FILE != 0
+
+	val finished: Boolean
+		get() = readInt(FLAGS, NO_STATUS_FLAGS) and STATUS_FINISHED != 0
+
+	/**
+	 * Bytes currently allocated by this decoder, including its libFLAC instance.
+	 */
+	val memoryFootprint: Long
+		get() = readLong(MEMORY_FOOTPRINT)
+
+	/**
+	 * Fills [out] with consistent snapshot of position and buffer state, read without
+	 * JNI calls nor allocations.
+	 */
+	fun readStatus(out: Status): Status {
+		val s = statusBuffer
+		if (s == null) {
+			out.pcmFramesPosition = 0L
+			out.bytesReadyCount = 0L
+			out.endOfFile = true
+			out.finished = true
+			return out
+		}
+
+		while (true) {
+			val before = beginRead(s)
+			if (before and 1 != 0)
+				continue
+			val flags = s.getInt(FLAGS)
+			out.pcmFramesPosition = s.getLong(PCM_FRAMES_POSITION)
+			out.bytesReadyCount = s.getLong(BYTES_READY_COUNT)
+			if (endRead(s, before)) {
+				out.endOfFile = flags and STATUS_END_OF_FILE != 0
+				out.finished = flags and STATUS_FINISHED != 0
+				return out
+			}
+		}
+	}
+
+	/**
+	 * Allocating variant of [readStatus], for polls outside of audio callback.
+	 */
+	val status: Status
+		get() = readStatus(Status())
+
+	private fun readInt(offset: Int, default: Int = 0): Int {
+		val s = statusBuffer ?: return default
+		while (true) {
+			val before = beginRead(s)
+			if (before and 1 != 0)
+				continue
+			val value = s.getInt(offset)
+			if (endRead(s, before))
+				return value
+		}
+	}
+
+	private fun readLong(offset: Int): Long {
+		val s = statusBuffer ?: return 0L
+		while (true) {
+			val before = beginRead(s)
+			if (before and 1 != 0)
+				continue
+			val value = s.getLong(offset)
+			if (endRead(s, before))
+				return value
+		}
+	}
+
+	private fun beginRead(s: ByteBuffer): Int {
+		val sequence = s.getInt(SEQUENCE)
+		acquireFence()
+		return sequence
+	}
+
+	private fun endRead(s: ByteBuffer, before: Int): Boolean {
+		loadLoadFence()
+		return s.getInt(SEQUENCE) == before
+	}
+
+	// volatile read is acquire, keeps following plain reads of status page from moving above it
+	private fun acquireFence(): Int = barrier
+
+	// plain reads can't move below volatile store, following reads can't move above volatile
+	// load and the two volatiles aren't reordered with each other, so together they order
+	// loads before and after like VarHandle.loadLoadFence, which needs API 33
+	private fun loadLoadFence(): Int {
+		barrier = 0
+		return barrier
+	}
+
+	private external fun create(dataReader: DataReader, cacheDirectory: String?,
+	                            cacheKey: String?, cacheBudgetBytes: Long,
+	                            lowFootprint: Boolean, pooledMemory: Boolean): ByteBuffer?
+
+	private external fun createCursor(streamPointer: ByteBuffer, lowFootprint: Boolean,
+	                                  pooledMemory: Boolean): ByteBuffer?
 
 	private external fun release(pointer: ByteBuffer)
 
+	private external fun getStatusBuffer(pointer: ByteBuffer): ByteBuffer
+
 	private external fun step(pointer: ByteBuffer): Boolean
 
 	private external fun read(pointer: ByteBuffer, buffer: ByteArray, length: Long): Long
 
-	private external fun seekTo(pointer: ByteBuffer, position: Long)
+	private external fun seekTo(pointer: ByteBuffer, position: Long, mode: Int)
+
+	private external fun setOutputMatrix(pointer: ByteBuffer, outputChannelsCount: Int,
+	                                     matrix: FloatArray?): Boolean
 
-	private external fun getSampleRate(pointer: ByteBuffer): Int
+	private external fun setOutputFormat(pointer: ByteBuffer, format: Int): Boolean
 
-	private external fun getChannelsCount(pointer: ByteBuffer): Int
+	private external fun setReplayGain(pointer: ByteBuffer, mode: Int, preampDb: Float)
 
-	private external fun getBitsPerSample(pointer: ByteBuffer): Int
+	private external fun setReverse(pointer: ByteBuffer, enabled: Boolean): Boolean
 
-	private external fun getTotalSamplesCount(pointer: ByteBuffer): Long
+	private external fun setPipeline(pointer: ByteBuffer, workersCount: Int): Boolean
 
-	private external fun getPcmFramesPosition(pointer: ByteBuffer): Long
+	private external fun setScrub(pointer: ByteBuffer, speed: Float, maxFramesPerSecond: Int,
+	                              maxBytesPerSecond: Long): Boolean
 
-	private external fun getBytesReadyCount(pointer: ByteBuffer): Long
+	private external fun setAnalysis(pointer: ByteBuffer, enabled: Boolean,
+	                                 analyzeOnly: Boolean): Boolean
+
+	private external fun getLoudness(pointer: ByteBuffer): DoubleArray?
+
+	private external fun analyze(pointer: ByteBuffer): DoubleArray?
+
+	companion object {
+		const val REPLAY_GAIN_OFF = 0
+		const val REPLAY_GAIN_TRACK = 1
+		const val REPLAY_GAIN_ALBUM = 2
+
+		const val FORMAT_S16 = 0
+		const val FORMAT_S32 = 1
+		const val FORMAT_FLOAT = 2
+
+		const val SEEK_EXACT = 0
+		const val SEEK_NEAREST_FRAME = 1
+		const val SEEK_PREVIOUS_FRAME = 2
+		const val SEEK_NEAREST_SEEK_POINT = 3
+
+		// hipxel_FlacDecoderStatus layout
+		private const val SEQUENCE = 0
+		private const val FLAGS = 4
+		private const val PCM_FRAMES_POSITION = 8
+		private const val BYTES_READY_COUNT = 16
+		private const val TOTAL_SAMPLES_COUNT = 24
+		private const val SAMPLE_RATE = 32
+		private const val CHANNELS_COUNT = 36
+		private const val BITS_PER_SAMPLE = 40
+		private const val OUTPUT_CHANNELS_COUNT = 44
+		private const val MEMORY_FOOTPRINT = 48
+
+		private const val STATUS_END_OF_FILE = 1
+		private const val STATUS_FINISHED = 2
+		private const val NO_STATUS_FLAGS = STATUS_END_OF_FILE or STATUS_FINISHED
+	}
 
-	private object Loader {
+	internal object Loader {
 		private val loaded by lazy {
 			try {
 				System.loadLibrary("HipxelFlacDecoder")
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.hipxel.flac
+
+import java.nio.ByteBuffer
+
+/**
+ * Mixes decoders added as sources into one interleaved 16-bit stream read with [read].
+ * All sources must have [sampleRate] and [channelsCount] output channels, each keeps its own
+ * position and gain. Sources are decoded on demand, least buffered first, so none runs dry
+ * while others are ahead.
+ */
+class FlacMixer(
+		val sampleRate: Int,
+		val channelsCount: Int,
+		pooledMemory: Boolean = false
+) {
+	private var pointer: ByteBuffer? = null
+
+	init {
+		if (!FlacDecoder.Loader.loadNative())
+			throw IllegalStateException("native library is not loaded")
+
+		pointer = create(sampleRate, channelsCount, pooledMemory)
+		if (pointer == null)
+			throw IllegalStateException("native create failed")
+	}
+
+	/**
+	 * Mixer takes over [decoder], which must not be used afterwards. Returns index of source
+	 * or -1 when there is no free slot or decoder format doesn't match, decoder is then untouched.
+	 */
+	fun addSource(decoder: FlacDecoder, gain: Float = 1f): Int {
+		val p = pointer ?: return -1
+		val d = decoder.detach() ?: return -1
+		val index = addSource(p, d, gain)
+		if (index < 0)
+			decoder.attach(d)
+		return index
+	}
+
+	fun removeSource(index: Int) {
+		pointer?.let { removeSource(it, index) }
+	}
+
+	/**
+	 * Gain changes linearly over [rampFrames] output frames, which gives crossfades
+	 * when one source goes up while other goes down.
+	 */
+	fun setGain(index: Int, gain: Float, rampFrames: Long = 0L): Boolean {
+		return pointer?.let { setGain(it, index, gain, rampFrames) } ?: false
+	}
+
+	fun setPaused(index: Int, paused: Boolean): Boolean {
+		return pointer?.let { setPaused(it, index, paused) } ?: false
+	}
+
+	fun seekSource(index: Int, position: Long, mode: Int = FlacDecoder.SEEK_EXACT): Boolean {
+		return pointer?.let { seekSource(it, index, position, mode) } ?: false
+	}
+
+	fun sourcePosition(index: Int): Long {
+		return pointer?.let { getSourcePosition(it, index) } ?: -1L
+	}
+
+	/**
+	 * Decodes ahead for source with least frames buffered, if it has fewer than [framesAhead].
+	 * Returns false when nothing needed decoding.
+	 */
+	fun step(framesAhead: Long): Boolean {
+		return pointer?.let { step(it, framesAhead) } ?: false
+	}
+
+	/**
+	 * Returns 0 once every source is finished.
+	 */
+	fun read(buffer: ByteArray, length: Long): Long {
+		return pointer?.let { read(it, buffer, length) } ?: -1L
+	}
+
+	fun release() {
+		pointer?.let {
+			pointer = null
+			release(it)
+		}
+	}
+
+	private external fun create(sampleRate: Int, channelsCount: Int,
+	                            pooledMemory: Boolean): ByteBuffer?
+
+	private external fun release(pointer: ByteBuffer)
+
+	private external fun addSource(pointer: ByteBuffer, decoderPointer: ByteBuffer, gain: Float): Int
+
+	private external fun removeSource(pointer: ByteBuffer, index: Int)
+
+	private external fun setGain(pointer: ByteBuffer, index: Int, gain: Float,
+	                             rampFrames: Long): Boolean
+
+	private external fun setPaused(pointer: ByteBuffer, index: Int, paused: Boolean): Boolean
+
+	private external fun seekSource(pointer: ByteBuffer, index: Int, position: Long,
+	                                mode: Int): Boolean
+
+	private external fun getSourcePosition(pointer: ByteBuffer, index: Int): Long
+
+	private external fun step(pointer: ByteBuffer, framesAhead: Long): Boolean
+
+	private external fun read(pointer: ByteBuffer, buffer: ByteArray, length: Long): Long
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2020 Janusz Jankowski
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.hipxel.flac
+
+import java.nio.ByteBuffer
+
+/**
+ * Source parsed once and shared by cursors, each cursor is a [FlacDecoder] with its own
+ * position and output. Frame data read by one cursor is kept in block cache of
+ * [blockCacheBytes] for others. Cursors may be used from different threads.
+ */
+class FlacStream(
+		dataReader: DataReader,
+		diskCache: DiskCache? = null,
+		blockCacheBytes: Long = DEFAULT_BLOCK_CACHE_BYTES
+) {
+	internal var pointer: ByteBuffer? = null
+		private set
+
+	init {
+		if (!FlacDecoder.Loader.loadNative())
+			throw IllegalStateException("native library is not loaded")
+
+		pointer = create(dataReader, diskCache?.directory, diskCache?.key,
+				diskCache?.budgetBytes ?: 0L, blockCacheBytes)
+		if (pointer == null)
+			throw IllegalStateException("native create failed")
+	}
+
+	/**
+	 * Cursors keep stream data alive, so stream may be released before them.
+	 */
+	fun openCursor(lowFootprint: Boolean = false, pooledMemory: Boolean = false): FlacDecoder {
+		if (pointer == null)
+			throw IllegalStateException("stream is released")
+		return FlacDecoder(this, lowFootprint, pooledMemory)
+	}
+
+	/**
+	 * Writes samples from [startSample] until [endSample] to new FLAC file at [outputPath].
+	 * Whole frames are copied, only frames cut by range ends are encoded again.
+	 * Needs source with known size and samples count.
+	 */
+	fun trim(outputPath: String, startSample: Long, endSample: Long): Boolean {
+		return pointer?.let { trim(it, outputPath, startSample, endSample) } ?: false
+	}
+
+	/**
+	 * Splits stream at [samplePosition] into [firstPath] and [secondPath].
+	 */
+	fun split(samplePosition: Long, firstPath: String, secondPath: String): Boolean {
+		return trim(firstPath, 0L, samplePosition) && trim(secondPath, samplePosition, Long.MAX_VALUE)
+	}
+
+	fun release() {
+		pointer?.let {
+			pointer = null
+			release(it)
+		}
+	}
+
+	private external fun create(dataReader: DataReader, cacheDirectory: String?,
+	                            cacheKey: String?, cacheBudgetBytes: Long,
+	                            blockCacheBytes: Long): ByteBuffer?
+
+	private external fun release(pointer: ByteBuffer)
+
+	private external fun trim(pointer: ByteBuffer, outputPath: String,
+	                          startSample: Long, endSample: Long): Boolean
+
+	companion object {
+		const val DEFAULT_BLOCK_CACHE_BYTES = 1024L * 1024L
+	}
+}